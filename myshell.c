@@ -11,6 +11,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <pwd.h>
 #include <time.h>
 #include <ctype.h>
@@ -21,28 +23,681 @@
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <termios.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #include <sys/types.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 
 #define BUFFER_SIZE          256
 #define MAX_PATH_LENGTH      256
 #define MAX_FILENAME_LENGTH  256
+#define DIR_STACK_SIZE       32
+#define GIT_BRANCH_LENGTH    64
+#define PROMPT_BUDGET_MS     20
+
+// Bounds and tuning for the adaptive I/O concurrency governor
+#define MIN_WORKERS          1
+#define MAX_WORKERS          32
+#define GOVERNOR_INTERVAL_MS 100
+#define PSI_LIMIT            10.0
+#define LATENCY_LIMIT        2.0
+
+#define MAX_ARGS             128
+
+// Command lines grow past BUFFER_SIZE once $(...) substitutions are expanded
+#define EXPANDED_SIZE        8192
+#define MAX_SUBSTITUTION_DEPTH 8
+
+#define MAX_FUNCTIONS        64
+#define MAX_FUNCTION_COMMANDS 16
+#define MAX_CALL_DEPTH       32
+
+// Slots in the table of resolved command names; a power of two
+#define COMMAND_CACHE_SIZE   128
+
+// Slots in the direct-mapped file metadata cache used by test
+#define METADATA_CACHE_SIZE  256
+
+#define OUTPUT_BUFFER_SIZE   (64 * 1024)
+
+// ps: bytes of /proc directory entries read per getdents64 call, and of
+// each command line kept
+#define PROC_BUFFER_SIZE     (64 * 1024)
+#define COMMAND_LENGTH       128
+
+// df: how long to wait for statfs on all mounts, and how long an answer is
+// reused by the next df
+#define DF_TIMEOUT_MS        500
+#define DF_CACHE_MS          2000
+
+// watch: paths that can trigger a rerun, and how long to wait after a
+// change for more to arrive before rerunning
+#define WATCH_MAX_PATHS      16
+#define WATCH_SETTLE_MS      50
+
+// file: bytes read from the start of each file, nodes in the signature
+// trie, and room for each answer
+#define FILE_HEAD_SIZE       4096
+#define FILE_TRIE_NODES      1024
+#define FILE_RESULT_LENGTH   128
+
+// jl and agg split their input at line boundaries into chunks of at least
+// this many bytes, one per worker
+#define MIN_CHUNK_SIZE       (1 << 20)
+#define JL_MAX_FIELDS        16
+#define JL_MAX_FILTERS       8
+#define JL_MAX_DEPTH         8
+
+// agg keeps a histogram with AGG_SUB_BUCKETS buckets per power of two from
+// 2^AGG_MIN_EXPONENT upwards, one for each sign, so percentiles are within
+// about 1% of the true value and histograms of chunks can simply be added
+#define AGG_SUB_BITS         6
+#define AGG_SUB_BUCKETS      (1 << AGG_SUB_BITS)
+#define AGG_MIN_EXPONENT     (-64)
+#define AGG_EXPONENTS        128
+#define AGG_BUCKETS          (AGG_EXPONENTS * AGG_SUB_BUCKETS)
+#define AGG_MAX_PERCENTILES  8
+// Up to this many values are also kept, so percentiles can be exact; past
+// it only the histogram is used, which is within 0.8% of the true value
+#define AGG_EXACT_LIMIT      (1 << 22)
+
+// Slots in the table of LS_COLORS extensions; a power of two
+#define COLOR_TABLE_SIZE     512
+
+// Slots in the cache of canonicalized directories used by realpath
+#define PREFIX_CACHE_SIZE    64
+
+// --inode-order stats the names it batches in one directory when there are
+// fewer than this many; more are looked up with one pass over the directory
+#define INODE_SCAN_MIN       16
+
+// Files at least this large are truncated in steps before the final close
+// when rm is given --gradual, so their extents are freed a little at a time
+#define TRUNCATE_THRESHOLD   (1L << 30)
+#define TRUNCATE_STEP        (256L << 20)
+#define TRUNCATE_PAUSE_MS    20
+
+// A --durable command fsyncs up to this many distinct directories and files
+// it touched; beyond that it falls back to one syncfs per filesystem
+#define DURABLE_MAX_PATHS    16
+
+#define TEE_CHUNK            (64 * 1024)
+
+// base64 encodes 57 bytes to each 76 character line, and reads this many
+// lines' worth of input at a time
+#define BASE64_LINE          57
+#define BASE64_CHUNK         (BASE64_LINE * 1152)
+
+// dd buffers are aligned for O_DIRECT on any common logical block size
+#define DD_ALIGNMENT         4096
+#define DD_DEFAULT_BS        512
+// Smallest logical block size; O_DIRECT transfers must be a multiple of it
+#define DD_SECTOR            512
+
+#define SPLIT_DEFAULT_LINES  1000
+
+// The pager indexes line starts this many bytes at a time in the background
+#define INDEX_CHUNK          (1 << 20)
+#define SEARCH_LENGTH        128
+
+#define GRADUAL_OFF          0
+#define GRADUAL_FOREGROUND   1
+#define GRADUAL_BACKGROUND   2
+
+// I/O scheduling classes understood by ioprio_set(2)
+#define IOPRIO_WHO_PROCESS   1
+#define IOPRIO_CLASS_SHIFT   13
+#define IOPRIO_CLASS_RT      1
+#define IOPRIO_CLASS_BE      2
+#define IOPRIO_CLASS_IDLE    3
+
+// Optional prompt segments, selected with the "prompt" command
+#define PROMPT_GIT     0x1
+#define PROMPT_STATUS  0x2
+#define PROMPT_JOBS    0x4
+#define PROMPT_TIME    0x8
 
 static char buffer[BUFFER_SIZE] = {0};
 static char filename[MAX_FILENAME_LENGTH] = {0};
+static char expanded[EXPANDED_SIZE] = {0};
+
+// Every command is a builtin, so $(...) runs in the shell itself with its
+// standard output pointed at an in-memory file, one per nesting level and
+// reused from one substitution to the next
+static int capture_fds[MAX_SUBSTITUTION_DEPTH];
+static int capture_depth = 0;
+
+// Each directory stack entry holds an O_PATH descriptor for the directory so
+// popd can fchdir() straight back to it without resolving the path again.
+// The path is only kept for display and may be stale if the directory moved.
+struct dir_entry {
+  int  fd;
+  char path[MAX_PATH_LENGTH];
+};
+
+static struct dir_entry dir_stack[DIR_STACK_SIZE];
+static int dir_stack_top = 0;
+
+// Prompt state. The git branch is looked up on a worker thread so a slow
+// filesystem never holds up the prompt; everything below prompt_lock is
+// shared with that worker.
+static int prompt_segments = 0;
+static int last_status = 0;
+static long last_duration_ms = 0;
+static atomic_int active_jobs = 0;
+
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prompt_request = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prompt_result = PTHREAD_COND_INITIALIZER;
+static bool prompt_worker_started = false;
+static bool prompt_late = false;
+static bool waiting_for_input = false;
+static unsigned long prompt_request_gen = 0;
+static unsigned long prompt_result_gen = 0;
+static char prompt_dir[MAX_PATH_LENGTH];
+static char prompt_branch[GIT_BRANCH_LENGTH];
+
+// Controls how many operations the parallel builtins keep in flight. The
+// limit grows by one while latency and pressure stay low and is halved when
+// the filesystem shows signs of saturation (AIMD, as in TCP).
+struct io_governor {
+  pthread_mutex_t lock;
+  pthread_cond_t  slot;
+  int             limit;
+  int             active;
+  double          latency_us;   // moving average of per-operation latency
+  double          baseline_us;  // best moving average seen recently
+  struct timespec last_adjust;
+};
+
+static struct io_governor governor = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .slot = PTHREAD_COND_INITIALIZER,
+  .limit = 4,
+};
+
+// A name queued for a batch operation, with its inode number when known
+struct batch_entry {
+  char* name;
+  ino_t ino;
+};
+
+// A set of names within one directory that workers operate on in parallel
+struct batch {
+  int                 dirfd;
+  struct batch_entry* entries;
+  int                 count;
+  int                 capacity;
+  atomic_int          next;
+  atomic_int          failures;
+  int                 (*op)(int dirfd, const char* name, void* arg);
+  void*               arg;
+};
+
+// Worker threads shared by every batch of a command, so a walk over many
+// directories starts its threads once instead of once per directory. The
+// pool grows to follow the governor's limit and is stopped by the command.
+struct batch_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t  work;        // a batch was posted, or the pool is stopping
+  pthread_cond_t  idle;        // the last busy worker left a batch
+  struct batch*   batch;       // batch being run, or NULL
+  unsigned long   generation;  // counts posted batches
+  int             busy;
+  bool            stop;
+  int             count;
+  pthread_t       threads[MAX_WORKERS];
+};
+
+static struct batch_pool batch_pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .idle = PTHREAD_COND_INITIALIZER,
+};
+
+// Set while a command asked for its batches to be issued in inode order
+static bool inode_order = false;
+
+// How rm releases the space of large files, set per command by its options
+static int gradual_delete = GRADUAL_OFF;
+
+// Paths modified by a --durable command, flushed together when it finishes
+static bool durable = false;
+static bool durable_overflow = false;
+static char durable_paths[DURABLE_MAX_PATHS][MAX_PATH_LENGTH];
+static int durable_count = 0;
+static dev_t durable_devices[DURABLE_MAX_PATHS];
+static int durable_device_count = 0;
+static bool durable_sync_all = false;   // more devices than durable_devices holds
+
+// A magic number recognized by file, found at a fixed offset
+struct signature {
+  int         offset;
+  const char* bytes;
+  int         length;
+  const char* description;
+};
+
+#define SIGNATURE(offset, bytes, description) { offset, bytes, sizeof(bytes) - 1, description }
+
+static const struct signature signatures[] = {
+  SIGNATURE(0, "\x7f" "ELF\x01", "ELF 32-bit"),
+  SIGNATURE(0, "\x7f" "ELF\x02", "ELF 64-bit"),
+  SIGNATURE(0, "#!", "script text executable"),
+  SIGNATURE(0, "#!/bin/sh", "POSIX shell script text executable"),
+  SIGNATURE(0, "#!/bin/bash", "Bourne-Again shell script text executable"),
+  SIGNATURE(0, "#!/usr/bin/env bash", "Bourne-Again shell script text executable"),
+  SIGNATURE(0, "#!/usr/bin/env python", "Python script text executable"),
+  SIGNATURE(0, "#!/usr/bin/python", "Python script text executable"),
+  SIGNATURE(0, "#!/usr/bin/env perl", "Perl script text executable"),
+  SIGNATURE(0, "#!/usr/bin/perl", "Perl script text executable"),
+  SIGNATURE(0, "%PDF-", "PDF document"),
+  SIGNATURE(0, "%!PS", "PostScript document"),
+  SIGNATURE(0, "\x89PNG\r\n\x1a\n", "PNG image data"),
+  SIGNATURE(0, "\xff\xd8\xff", "JPEG image data"),
+  SIGNATURE(0, "GIF87a", "GIF image data, version 87a"),
+  SIGNATURE(0, "GIF89a", "GIF image data, version 89a"),
+  SIGNATURE(0, "II*\x00", "TIFF image data, little-endian"),
+  SIGNATURE(0, "MM\x00*", "TIFF image data, big-endian"),
+  SIGNATURE(0, "RIFF", "RIFF (little-endian) data"),
+  SIGNATURE(0, "OggS", "Ogg data"),
+  SIGNATURE(0, "fLaC", "FLAC audio bitstream data"),
+  SIGNATURE(0, "ID3", "Audio file with ID3 version 2"),
+  SIGNATURE(0, "\x1a\x45\xdf\xa3", "Matroska data"),
+  SIGNATURE(0, "PK\x03\x04", "Zip archive data"),
+  SIGNATURE(0, "PK\x05\x06", "Zip archive data (empty)"),
+  SIGNATURE(0, "\x1f\x8b", "gzip compressed data"),
+  SIGNATURE(0, "BZh", "bzip2 compressed data"),
+  SIGNATURE(0, "\xfd" "7zXZ\x00", "XZ compressed data"),
+  SIGNATURE(0, "\x28\xb5\x2f\xfd", "Zstandard compressed data"),
+  SIGNATURE(0, "\x04\x22\x4d\x18", "LZ4 compressed data"),
+  SIGNATURE(0, "7z\xbc\xaf\x27\x1c", "7-zip archive data"),
+  SIGNATURE(0, "Rar!\x1a\x07", "RAR archive data"),
+  SIGNATURE(0, "!<arch>\n", "current ar archive"),
+  SIGNATURE(0, "!<arch>\ndebian-binary", "Debian binary package"),
+  SIGNATURE(0, "\xed\xab\xee\xdb", "RPM package"),
+  SIGNATURE(0, "SQLite format 3\x00", "SQLite 3.x database"),
+  SIGNATURE(0, "\x89HDF\r\n\x1a\n", "Hierarchical Data Format (version 5) data"),
+  SIGNATURE(0, "PAR1", "Apache Parquet"),
+  SIGNATURE(0, "ARROW1", "Apache Arrow columnar file"),
+  SIGNATURE(0, "Obj\x01", "Apache Avro"),
+  SIGNATURE(0, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", "Composite Document File V2 Document"),
+  SIGNATURE(0, "\xca\xfe\xba\xbe", "compiled Java class data"),
+  SIGNATURE(0, "\xcf\xfa\xed\xfe", "Mach-O 64-bit"),
+  SIGNATURE(0, "MZ", "MS-DOS executable"),
+  SIGNATURE(0, "\x00" "asm", "WebAssembly (wasm) binary module"),
+  SIGNATURE(0, "wOFF", "Web Open Font Format"),
+  SIGNATURE(0, "wOF2", "Web Open Font Format (Version 2)"),
+  SIGNATURE(0, "{\\rtf", "Rich Text Format data"),
+  SIGNATURE(0, "<?xml", "XML document text"),
+  SIGNATURE(0, "<!DOCTYPE html", "HTML document text"),
+  SIGNATURE(0, "<html", "HTML document text"),
+  SIGNATURE(0, "-----BEGIN CERTIFICATE-----", "PEM certificate"),
+  SIGNATURE(0, "-----BEGIN ", "PEM data"),
+  SIGNATURE(0, "\xef\xbb\xbf", "UTF-8 Unicode (with BOM) text"),
+  SIGNATURE(4, "ftyp", "ISO Media"),
+  SIGNATURE(257, "ustar", "POSIX tar archive"),
+};
+
+// The signatures compiled into one trie per distinct offset. Node 0 is
+// unused so that 0 can mean "no child".
+struct trie_node {
+  short       next[256];
+  const char* description;
+};
+
+static struct trie_node file_trie[FILE_TRIE_NODES];
+static int file_trie_used = 1;
+static int file_trie_roots[8];
+static int file_trie_offsets[8];
+static int file_trie_count = 0;
+static pthread_once_t file_trie_once = PTHREAD_ONCE_INIT;
+
+// A file run shared by its workers, each of which claims the next name
+struct file_job {
+  struct batch* files;
+  char          (*results)[FILE_RESULT_LENGTH];
+  atomic_int    next;
+  atomic_int    failures;
+};
+
+// A piece of a mapped file, starting and ending at line boundaries, handled
+// by one worker. Output collects in the chunk and is written out in chunk
+// order once all workers are done.
+struct line_chunk {
+  const char* start;
+  const char* end;
+  char*       out;
+  size_t      used;
+  size_t      capacity;
+  void*       job;
+  void*       state;
+};
+
+// Positions of the structural characters of one JSON record: braces,
+// brackets, colons, commas and the quotes around strings
+struct json_index {
+  uint32_t* positions;
+  size_t    count;
+  size_t    capacity;
+};
+
+// A dotted field path such as "request.status" split into its keys
+struct json_path {
+  const char* keys[JL_MAX_DEPTH];
+  int         lengths[JL_MAX_DEPTH];
+  int         depth;
+};
+
+// A jl --where condition
+struct jl_filter {
+  struct json_path path;
+  char             op[3];
+  const char*      value;
+  double           number;
+};
+
+// What jl looks for, shared read-only by its workers
+struct jl_job {
+  struct json_path fields[JL_MAX_FIELDS];
+  int              field_count;
+  struct jl_filter filters[JL_MAX_FILTERS];
+  int              filter_count;
+};
+
+// Running totals of one column for agg, kept per chunk and then merged
+struct agg_stats {
+  unsigned long long count;
+  unsigned long long skipped;    // lines without a number in the column
+  unsigned long long zeros;
+  double             sum;
+  double             min;
+  double             max;
+  unsigned long long positive[AGG_BUCKETS];
+  unsigned long long negative[AGG_BUCKETS];
+  double*            values;     // every value while exact, else NULL
+  size_t             capacity;
+  bool               inexact;    // too many values were seen to keep them
+};
+
+// Which column agg reads, shared read-only by its workers
+struct agg_job {
+  int    field;                  // counting from 1
+  char   delimiter;              // 0 for runs of blanks
+  size_t exact_limit;            // values each chunk may keep
+};
+
+// Set while ls was asked for --color
+static bool ls_color = false;
+
+// Escape sequences for ls --color, parsed once from LS_COLORS. Extensions
+// such as ".tar.gz" are hashed into an open addressed table; other suffix
+// patterns such as "~" are few and kept in a list.
+struct color_entry {
+  const char* key;
+  size_t      length;
+  const char* sequence;
+};
+
+static struct color_entry color_table[COLOR_TABLE_SIZE];
+static int color_count = 0;
+static struct color_entry color_suffixes[16];
+static int color_suffix_count = 0;
+static const char* type_colors[8];   // di ln pi so bd cd ex fi
+static pthread_once_t colors_once = PTHREAD_ONCE_INIT;
+
+// A dd transfer shared by its workers, each of which claims the next block
+struct dd_job {
+  int         in;
+  int         out;
+  int         out_buffered;  // output without O_DIRECT for a short last block, or -1
+  long long   bs;
+  long long   skip;
+  long long   seek;
+  long long   blocks;
+  atomic_llong next;
+  atomic_llong copied;
+  atomic_int  failed;
+};
+
+// A split in progress. Chunk i covers bytes starts[i] up to starts[i + 1].
+struct split_job {
+  int         in;
+  const char* prefix;
+  int         suffix_length;
+  off_t*      starts;
+  int         chunks;
+  atomic_int  next;
+  atomic_int  failed;
+};
+
+// Offsets of line starts in a mapped file, filled in by a background thread
+// the first time the pager needs a line number
+struct line_index {
+  pthread_mutex_t lock;
+  pthread_cond_t  grown;
+  pthread_t       thread;
+  const char*     data;
+  off_t           size;
+  off_t*          offsets;
+  long            count;
+  long            capacity;
+  bool            started;
+  bool            done;
+  bool            stop;
+};
+
+// I/O priority and rate limits for bulk builtins. The "throttle" command sets
+// the shell-wide default; --ioprio and --rate override it for one command.
+struct throttle {
+  int    ioprio;          // 0 leaves the I/O priority alone
+  double bytes_per_sec;   // 0 means unlimited
+  double ops_per_sec;     // 0 means unlimited
+};
+
+// Token bucket holding up to one second's worth of budget
+struct token_bucket {
+  pthread_mutex_t lock;
+  double          tokens;
+  struct timespec last;
+};
+
+// A large unlinked file whose space is being released by a background job,
+// with its own copy of the throttle in effect when it was removed
+struct truncate_job {
+  int                 fd;
+  struct throttle     throttle;
+  struct token_bucket ops;
+};
+
+static struct throttle default_throttle = {0};
+static struct throttle active_throttle = {0};
+static struct token_bucket byte_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct token_bucket op_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Builtins that take their arguments as an argument vector
+typedef int (*builtin_handler)(int argc, char** argv);
+
+struct builtin {
+  const char*     name;
+  builtin_handler handler;
+};
+
+// One command of an alias or function body, split into words when the body
+// was defined. params[i] is N when word i is $N, -1 for $@, -2 for a word
+// with parameters inside it such as $1/$2, and 0 otherwise.
+struct compiled_command {
+  char*        text;      // set instead of argv when it has $(...) in it
+  int          argc;
+  char**       argv;
+  signed char* params;
+};
+
+struct shell_function {
+  char*                    name;
+  char*                    text;     // body as typed, for listing
+  char*                    storage;  // body split into words in place
+  bool                     alias;
+  struct compiled_command* commands;
+  int                      count;
+};
+
+static struct shell_function functions[MAX_FUNCTIONS];
+static int function_count = 0;
+
+// Definitions whose bodies are running, innermost last
+static struct shell_function* running[MAX_CALL_DEPTH];
+static int running_count = 0;
+
+// What a command name resolved to. Aliases and functions come first, then
+// builtins; the PATH is searched only when a name is asked about with
+// which, type or hash, and the answer is kept until hash -r.
+struct command_entry {
+  char                   name[MAX_FILENAME_LENGTH];
+  struct shell_function* function;
+  builtin_handler        handler;
+  bool                   searched;   // PATH has been searched for the name
+  char*                  path;       // executable found on the PATH, or NULL
+  unsigned long          hits;
+};
+
+static struct command_entry command_cache[COMMAND_CACHE_SIZE];
+static int command_count = 0;
+static unsigned long command_hits = 0;
+static unsigned long command_misses = 0;
+
+// Cached statx and access results for a path. An entry is valid while its
+// generation matches metadata_generation, which moves on before each command
+// line and whenever a builtin changes files or the working directory.
+struct metadata_entry {
+  char          path[MAX_PATH_LENGTH];
+  unsigned long generation;
+  unsigned int  mask;        // statx fields fetched so far
+  int           error;       // errno from statx, or 0
+  struct statx  stats;
+  int           access_known;
+  int           access_ok;
+};
+
+static struct metadata_entry metadata_cache[METADATA_CACHE_SIZE];
+static atomic_ulong metadata_generation = 1;
+
+// A process seen by ps. The stat file stays open between refreshes of the
+// top view so each refresh costs one pread per process.
+struct process {
+  pid_t              pid;
+  int                fd;         // /proc/PID/stat, or -1 if out of descriptors
+  uid_t              uid;
+  pid_t              ppid;
+  char               state;
+  long               threads;
+  unsigned long      rss;        // pages
+  unsigned long long ticks;      // user and system time
+  unsigned long long previous;   // ticks at the previous refresh
+  char               command[COMMAND_LENGTH];
+};
+
+static struct process* processes = NULL;
+static size_t process_count = 0;
+
+// A statfs of one mount by df, running on its own detached worker. Probes
+// stay in df_probes between runs so recent answers are reused and a mount
+// whose worker is stuck is not probed again until the worker returns. A
+// probe is freed by whichever of the table and the worker lets go last, and
+// leaves the table once it finished and its mount is gone.
+struct df_probe {
+  char            target[MAX_PATH_LENGTH];
+  int             refs;       // guarded by df_lock
+  bool            done;
+  int             error;
+  struct statvfs  stats;
+  struct timespec finished;   // CLOCK_MONOTONIC
+};
+
+static struct df_probe** df_probes = NULL;
+static int df_probe_count = 0;
+static pthread_mutex_t df_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t df_finished = PTHREAD_COND_INITIALIZER;
+
+// A directory resolved by realpath: the absolute path as written, with any
+// symlinks and dot components still in it, and what it resolved to. An entry
+// is reused as long as the written path still leads to the same inode.
+struct prefix_entry {
+  char  path[MAX_PATH_LENGTH];
+  char  canonical[MAX_PATH_LENGTH];
+  dev_t dev;
+  ino_t ino;
+};
+
+static struct prefix_entry prefix_cache[PREFIX_CACHE_SIZE];
+
+// Output of echo and printf collects here and is written out in large
+// pieces, before anything else writes to standard output
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static size_t output_used = 0;
 
 // Implements various UNIX commands using POSIX system calls
 // Each must return an integer value indicating success or failure
 int do_cat(const char* filename);
+int do_base64(int argc, char** argv);
+int do_agg(int argc, char** argv);
+int do_basename(int argc, char** argv);
 int do_cd(char* dirname);
+int do_chmod(int argc, char** argv);
+int do_dirs(void);
 int do_ls(const char* dirname);
+int do_dd(int argc, char** argv);
+int do_df(int argc, char** argv);
+int do_dirname(int argc, char** argv);
+int do_hash(int argc, char** argv);
+int do_less(int argc, char** argv);
 int do_mkdir(const char* dirname);
+int do_mv(int argc, char** argv);
+int do_popd(void);
+int do_pushd(const char* dirname);
+int do_prompt(const char* segments);
+int do_ps(int argc, char** argv);
 int do_pwd(void);
+int do_realpath(int argc, char** argv);
 int do_rm(const char* filename);
 int do_rmdir(const char* dirname);
+int do_rm_tree(const char* dirname);
+int do_split(int argc, char** argv);
 int do_stat(char* filename);
+int do_echo(int argc, char** argv);
+int do_file(int argc, char** argv);
+int do_jl(int argc, char** argv);
+int do_printf(int argc, char** argv);
+int do_tee(int argc, char** argv);
+int do_test(int argc, char** argv);
+int do_throttle(int argc, char** argv);
+int do_touch(int argc, char** argv);
+int do_type(int argc, char** argv);
+int do_watch(int argc, char** argv);
+int do_which(int argc, char** argv);
 int execute_command(char* buffer);
+int expand_substitutions(const char* line, char* out, size_t size);
+int call_function(struct shell_function* function, int argc, char** argv);
+bool is_definition(const char* line);
   
 /**
  * @brief  Removes extraneous whitespace at the end of a command to avoid
@@ -58,258 +713,6380 @@ void strip_trailing_whitespace(char* string) {
 }
 
 /**
- * @brief Displays a command prompt including the current working directory
+ * @brief  Discards everything in the metadata cache
  */
-void display_prompt(void) {
-  char current_dir[MAX_PATH_LENGTH];
-  
-  if (getcwd(current_dir, sizeof(current_dir)) != NULL)
-    // Outputs the current working directory in bold green text (\033[32;1m)
-    // \033 is the escape sequence for changing text, 32 is green, 1 is bold
-    fprintf(stdout, "myshell:\033[32;1m%s\033[0m> ", current_dir);
+void invalidate_metadata(void) {
+  atomic_fetch_add(&metadata_generation, 1);
 }
 
 /**
- * @brief  Main program function
- * @param  Not used
- * @return EXIT_SUCCESS is always returned
+ * @brief  Counts the bytes of standard input that stdio read along with the
+ *         last command line but the shell has not used
+ * @return Number of bytes
  */
-int main(int argc, char** argv) {
-  while (true) {
-    display_prompt();
-    
-    // Read a line representing a command to execute from stdin into 
-    // a character array
-    if (fgets(buffer, BUFFER_SIZE, stdin) != 0) {
-      
-      // Clean up sloppy user input
-      strip_trailing_whitespace(buffer);
-      
-      //Reset filename buffer after each command execution
-      bzero(filename, MAX_FILENAME_LENGTH);     
-      
-      // As in most shells, "cd" and "exit" are special cases that need
-      // to be handled separately
-      if ((sscanf(buffer, "cd %s", filename) == 1) ||
-	  (!strncmp(buffer, "cd", BUFFER_SIZE))) 
-	do_cd(filename);
-      else if (!strncmp(buffer, "exit", BUFFER_SIZE)) 
-	exit(EXIT_SUCCESS);
-      else 
-	execute_command(buffer);
-    }
-  }
-  
-  return EXIT_SUCCESS;
+size_t read_ahead(void) {
+  return stdin->_IO_read_end - stdin->_IO_read_ptr;
 }
 
 /**
- * @brief  Changes the current working directory
- * @param  Char array representing the directory to change to, or if empty
- *         use the user's home directory
- * @return -1 on error, 0 on success
+ * @brief  Reads from a descriptor. For standard input, whatever stdio has
+ *         already read ahead of the command line is returned first, so
+ *         builtins reading their input directly see all of it.
+ * @param  Descriptor to read
+ * @param  Buffer
+ * @param  Size of the buffer
+ * @return Number of bytes read, 0 at end of input, or -1 on error
  */
-int do_cd(char* dirname) {
-  struct passwd *p = getpwuid(getuid());
+ssize_t read_input(int fd, void* data, size_t size) {
+  size_t buffered = fd == STDIN_FILENO ? read_ahead() : 0;
 
-  // If no argument, change to current user's home directory
-  if (strnlen(dirname, MAX_PATH_LENGTH) == 0)
-      strncpy(dirname, p->pw_dir, MAX_PATH_LENGTH);
-
-  // Otherwise, change to directory specified and check for error
-  if (chdir(dirname) < 0) {
-    fprintf(stderr, "cd: %s\n", strerror(errno));
-    return -1;
-  }
-
-  return 0;
+  if (buffered > 0)
+    return fread(data, 1, buffered < size ? buffered : size, stdin);
+  return read(fd, data, size);
 }
 
 /**
- * @brief  Lists the contents of a directory
- * @param  Name of directory to list, or if empty, use current working directory
+ * @brief  Writes a whole buffer, retrying after partial writes
+ * @param  Descriptor to write to
+ * @param  Data to write
+ * @param  Number of bytes to write
  * @return -1 on error, 0 on success
- */ 
-int do_ls(const char* dirname) {
-  struct dirent* d;
-  DIR* dir = opendir(dirname);
-  if(dir == NULL){
-    fprintf(stderr, "ls: %s\n", strerror(errno));
-    return -1;
-  }
-  errno = 0;
-  while((d=readdir(dir)) != NULL){
-    if(errno == 0) printf("%s\n",d->d_name);
-    else{
-      fprintf(stderr, "ls: Cannot read entry from directory... %s\n",strerror(errno));
-      closedir(dir);
+ */
+int write_all(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
       return -1;
     }
+    data += written;
+    length -= written;
   }
-  closedir(dir);
   return 0;
 }
 
 /**
- * @brief  Outputs the contents of a single ordinary file
- * @param  Name of file whose contents should be output
- * @return -1 on error, 0 on success
+ * @brief  Writes out whatever echo and printf have buffered
  */
-int do_cat(const char* filename) {
-  ssize_t bytesRead;
-  int fd = open(filename, O_RDONLY);
-
-  if(fd == -1){
-    close(fd);
-    fprintf(stderr, "cat: Cannot open file. %s\n",strerror(errno));
-    return fd;
-  }
-  while( (bytesRead = read(fd, buffer, BUFFER_SIZE)) != 0){
-    if(bytesRead == -1 || write(1, buffer, bytesRead) != bytesRead) {
-      close(fd);
-      fprintf(stderr, "cat: cannot read file. %s\n",strerror(errno));
-      return -1;
-    }
-    printf("\n");
-  }
-  close(fd);
-  return 0;
+void out_flush(void) {
+  if (output_used > 0)
+    write_all(STDOUT_FILENO, output_buffer, output_used);
+  output_used = 0;
 }
 
 /**
- * @brief  Creates a new directory
- * @param  Name of directory to create
- * @return -1 on error, 0 on success
+ * @brief  Adds bytes to the output buffer, flushing it when full
+ * @param  Data to add
+ * @param  Number of bytes
  */
-int do_mkdir(const char* dirname) {
-  int newDir = mkdir(dirname, 0777);
-  if(newDir == -1){
-      fprintf(stderr, "mkdir: Cannot create directory. %s.\n",strerror(errno));
-      return newDir;
+void out_write(const char* data, size_t length) {
+  if (output_used + length > sizeof(output_buffer)) {
+    out_flush();
+    if (length > sizeof(output_buffer)) {
+      write_all(STDOUT_FILENO, data, length);
+      return;
+    }
   }
-  else return newDir;
+  memcpy(output_buffer + output_used, data, length);
+  output_used += length;
 }
 
 /**
- * @brief  Removes an existing directory
- * @param  Name of directory to remove
- * @return -1 on error, 0 on success
+ * @brief  Adds one byte to the output buffer
+ * @param  Byte to add
  */
-int do_rmdir(const char* dirname) {
-  if(rmdir(dirname) == -1){
-    fprintf(stderr, "rmdir: Cannot remove directory. %s.\n",strerror(errno));
-    return -1;
-  }
-  else return 0;
+void out_char(char c) {
+  if (output_used == sizeof(output_buffer))
+    out_flush();
+  output_buffer[output_used++] = c;
 }
 
 /**
- * @brief  Outputs the name of the current working directory
- * @return Cannot fail. Always returns 1.
+ * @brief  Finds the branch checked out in the git repository containing a
+ *         directory by reading HEAD directly rather than running git
+ * @param  Directory to start searching from
+ * @param  Buffer receiving the branch name, or the short commit id when HEAD
+ *         is detached. Left empty when not inside a repository.
  */
-int do_pwd(void) {
-  char current_dir[MAX_PATH_LENGTH];
-  if(getcwd(current_dir, sizeof(current_dir)) == NULL){
-    fprintf(stderr, "pwd: Could not find current directory. %s.\n",strerror(errno));
+void read_git_branch(const char* dirname, char* branch) {
+  char path[2 * MAX_PATH_LENGTH + 16];
+  char head[MAX_PATH_LENGTH];
+  char dir[MAX_PATH_LENGTH];
+  ssize_t length = -1;
+  int fd;
+
+  branch[0] = 0;
+  snprintf(dir, sizeof(dir), "%s", dirname);
+
+  // Walk up towards the root until a .git directory (or gitfile) turns up
+  while (length == -1) {
+    snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 && errno == ENOTDIR) {
+      // Worktrees and submodules use a ".git" file pointing at the real one
+      snprintf(path, sizeof(path), "%s/.git", dir);
+      if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+        length = read(fd, head, sizeof(head) - 1);
+        close(fd);
+        fd = -1;
+        if (length > 8 && !strncmp(head, "gitdir: ", 8)) {
+          head[length] = 0;
+          head[strcspn(head, "\n")] = 0;
+          if (head[8] == '/')
+            snprintf(path, sizeof(path), "%s/HEAD", head + 8);
+          else
+            snprintf(path, sizeof(path), "%s/%s/HEAD", dir, head + 8);
+          fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        length = -1;
+      }
+    }
+    if (fd != -1) {
+      length = read(fd, head, sizeof(head) - 1);
+      close(fd);
+      break;
+    }
+
+    char* slash = strrchr(dir, '/');
+    if (slash == NULL || slash == dir)
+      return;
+    *slash = 0;
   }
-  printf("%s\n", current_dir);
-  return 1;
+
+  if (length <= 0)
+    return;
+  head[length] = 0;
+  head[strcspn(head, "\n")] = 0;
+  if (!strncmp(head, "ref: refs/heads/", 16))
+    snprintf(branch, GIT_BRANCH_LENGTH, "%.*s", GIT_BRANCH_LENGTH - 1, head + 16);
+  else
+    snprintf(branch, GIT_BRANCH_LENGTH, "%.7s", head);
 }
 
 /**
- * @brief  Removes (unlinks) a file
- * @param  Name of file to delete
- * @return -1 on error, 0 on success
+ * @brief  Writes the prompt for a directory using the most recent segment
+ *         values. Caller must hold prompt_lock.
+ * @param  Current working directory to show
  */
-int do_rm(const char* filename) {
-  int rm = unlink(filename);
-  if(rm == -1){
-    fprintf(stderr, "rm: Cannot remove file. %s.\n",strerror(errno));
-    return rm;
+void print_prompt(const char* current_dir) {
+  // Outputs the current working directory in bold green text (\033[32;1m)
+  // \033 is the escape sequence for changing text, 32 is green, 1 is bold
+  fprintf(stdout, "myshell:\033[32;1m%s\033[0m", current_dir);
+
+  if ((prompt_segments & PROMPT_GIT) && prompt_branch[0] != 0)
+    fprintf(stdout, " \033[35m(%s)\033[0m", prompt_branch);
+  if ((prompt_segments & PROMPT_STATUS) && last_status < 0)
+    fprintf(stdout, " \033[31;1m[%d]\033[0m", last_status);
+  if ((prompt_segments & PROMPT_JOBS) && atomic_load(&active_jobs) > 0)
+    fprintf(stdout, " {%d}", atomic_load(&active_jobs));
+  if (prompt_segments & PROMPT_TIME) {
+    if (last_duration_ms < 1000)
+      fprintf(stdout, " %ldms", last_duration_ms);
+    else
+      fprintf(stdout, " %.2fs", last_duration_ms / 1000.0);
   }
-  return rm;
+  fprintf(stdout, "> ");
+  fflush(stdout);
 }
 
 /**
- * @brief  Outputs information about a file
- * @param  Name of file to stat
- * @return -1 on error, 0 on success
+ * @brief  Worker thread that computes the slow prompt segments. If a result
+ *         arrives after the prompt was already drawn with a stale value, the
+ *         prompt line is redrawn in place while the shell waits for input.
+ * @param  Not used
+ * @return Never returns
  */
-int do_stat(char* filename) {
-  struct stat stats;
-  int result = stat(filename, &stats);
-  if(result == -1){
-    fprintf(stderr, "stat: Cannot retrieve file stats. %s.\n",strerror(errno));
-    return result;
-  }
-  printf("\nSTATS FOR \"%s\":\n", filename);
-  printf("Last access: %ld ns\n", stats.st_atime);
-  printf("Last modification: %ld ns\n", stats.st_mtime);
-  printf("Last change: %ld ns\n\n", stats.st_ctime);
+void* prompt_worker(void* arg) {
+  char dir[MAX_PATH_LENGTH];
+  char branch[GIT_BRANCH_LENGTH];
+  unsigned long gen;
 
-  printf("File owner ID: %d\nFile group owner ID: %d\n", stats.st_uid, stats.st_gid);
-  printf("File inode number: %ld\n", stats.st_ino);
-  printf("File type & mode: %d\n", stats.st_mode);
-  printf("File hard link count: %ld\n\n", stats.st_nlink);
+  (void) arg;
+  pthread_mutex_lock(&prompt_lock);
+  while (true) {
+    while (prompt_request_gen == prompt_result_gen)
+      pthread_cond_wait(&prompt_request, &prompt_lock);
+    gen = prompt_request_gen;
+    strncpy(dir, prompt_dir, sizeof(dir));
+    pthread_mutex_unlock(&prompt_lock);
 
-  printf("File size: %ld byte(s)\n", stats.st_size);
-  printf("File preferred block size: %ld\n", stats.st_blksize);
-  printf("Allocated %ld blocks of 512 bytes\n\n", stats.st_blocks);
-  
-  return result;
-}
+    read_git_branch(dir, branch);
 
-//Exits the program
-int do_q(){
-  exit(EXIT_SUCCESS);
+    pthread_mutex_lock(&prompt_lock);
+    bool changed = strcmp(branch, prompt_branch) != 0;
+    strncpy(prompt_branch, branch, sizeof(prompt_branch));
+    prompt_result_gen = gen;
+    pthread_cond_broadcast(&prompt_result);
+
+    if (prompt_late && changed && waiting_for_input &&
+        gen == prompt_request_gen && isatty(STDOUT_FILENO)) {
+      fprintf(stdout, "\r\033[K");
+      print_prompt(dir);
+    }
+    prompt_late = false;
+  }
+  return NULL;
 }
 
 /**
- * @brief  Executes a shell command. Checks for invalid commands.
- * @param  Char array representing the command to execute
- * @return Return value of command being executed, or -1 for invalid command
+ * @brief Displays a command prompt including the current working directory
+ *        and any enabled segments. Waits at most PROMPT_BUDGET_MS for the
+ *        git branch, falling back to the previous value if it is not ready.
  */
-int execute_command(char* buffer)  {
-  if (sscanf(buffer, "cat %s", filename) == 1) {
-    return do_cat(filename);
-  }
-  
-  if (sscanf(buffer, "stat %s", filename) == 1) {
-    return do_stat(filename);
-  }
-  
-  if (sscanf(buffer, "mkdir %s", filename) == 1) {
-    return do_mkdir(filename);
-  }
-  
-  if (sscanf(buffer, "rmdir %s", filename) == 1) {
-    return do_rmdir(filename);
-  }
+void display_prompt(void) {
+  char current_dir[MAX_PATH_LENGTH];
   
-  if (sscanf(buffer, "rm %s", filename) == 1) {
-    return do_rm(filename);
-  }
- 
-  if ((sscanf(buffer, "ls %s", filename) == 1) ||
-      (!strncmp(buffer, "ls", BUFFER_SIZE))) {
-    if (strnlen(filename, BUFFER_SIZE) == 0)
-      sprintf(filename, ".");
+  out_flush();
+  if (getcwd(current_dir, sizeof(current_dir)) == NULL)
+    return;
 
-    return do_ls(filename);
-  }
+  pthread_mutex_lock(&prompt_lock);
+  if (prompt_segments & PROMPT_GIT) {
+    struct timespec deadline;
+    pthread_t worker;
 
-  if (!strncmp(buffer, "pwd", BUFFER_SIZE)) {
-    return do_pwd();
-  }
+    if (!prompt_worker_started &&
+        pthread_create(&worker, NULL, prompt_worker, NULL) == 0) {
+      pthread_detach(worker);
+      prompt_worker_started = true;
+    }
 
-  if ((sscanf(buffer, "q %s", filename) == 1) ||
-      (!strncmp(buffer, "q", BUFFER_SIZE))) {
-    return do_q();
-  }
+    strncpy(prompt_dir, current_dir, sizeof(prompt_dir));
+    prompt_request_gen++;
+    pthread_cond_signal(&prompt_request);
 
-  // Invalid command
-  if (strnlen(buffer, BUFFER_SIZE) != 0)
-    fprintf(stderr, "myshell: %s: No such file or directory\n", buffer);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += PROMPT_BUDGET_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (prompt_worker_started && prompt_result_gen != prompt_request_gen)
+      if (pthread_cond_timedwait(&prompt_result, &prompt_lock, &deadline) != 0)
+        break;
+    prompt_late = prompt_result_gen != prompt_request_gen;
+  }
+  print_prompt(current_dir);
+  waiting_for_input = true;
+  pthread_mutex_unlock(&prompt_lock);
+}
+
+/**
+ * @brief  Selects the optional segments shown in the prompt
+ * @param  Comma separated list of segments (git, status, jobs, time), "none"
+ *         to show only the working directory, or empty to list the current
+ *         selection
+ * @return -1 on error, 0 on success
+ */
+int do_prompt(const char* segments) {
+  static const struct { const char* name; int flag; } names[] = {
+    { "git", PROMPT_GIT }, { "status", PROMPT_STATUS },
+    { "jobs", PROMPT_JOBS }, { "time", PROMPT_TIME },
+  };
+  char list[MAX_FILENAME_LENGTH];
+  int selected = 0;
+
+  if (strnlen(segments, MAX_FILENAME_LENGTH) == 0) {
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+      if (prompt_segments & names[i].flag)
+        printf("%s ", names[i].name);
+    printf("\n");
+    return 0;
+  }
+
+  strncpy(list, segments, sizeof(list) - 1);
+  list[sizeof(list) - 1] = 0;
+  for (char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    size_t i;
+    if (!strcmp(name, "none"))
+      continue;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+      if (!strcmp(name, names[i].name))
+        break;
+    if (i == sizeof(names) / sizeof(names[0])) {
+      fprintf(stderr, "prompt: Unknown segment \"%s\"\n", name);
+      return -1;
+    }
+    selected |= names[i].flag;
+  }
+
+  pthread_mutex_lock(&prompt_lock);
+  prompt_segments = selected;
+  pthread_mutex_unlock(&prompt_lock);
+  return 0;
+}
+
+/**
+ * @brief  Runs a command in-process with its standard output going to the
+ *         capture file of the current substitution depth
+ * @param  Command to run, already expanded; modified
+ * @return The capture file, valid until the next capture at this depth, or
+ *         -1 on error
+ */
+int run_captured(char* line) {
+  int saved, fd;
+
+  if (capture_depth == MAX_SUBSTITUTION_DEPTH) {
+    fprintf(stderr, "myshell: Substitutions nested too deeply\n");
+    return -1;
+  }
+  if (capture_fds[capture_depth] == 0)
+    capture_fds[capture_depth] = memfd_create("substitution", MFD_CLOEXEC);
+  if ((fd = capture_fds[capture_depth]) == -1 || ftruncate(fd, 0) == -1 ||
+      lseek(fd, 0, SEEK_SET) == -1) {
+    capture_fds[capture_depth] = fd == -1 ? 0 : fd;
+    return -1;
+  }
+
+  fflush(stdout);
+  out_flush();
+  saved = dup(STDOUT_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  capture_depth++;
+  bzero(filename, MAX_FILENAME_LENGTH);
+  execute_command(line);
+  fflush(stdout);
+  out_flush();
+  capture_depth--;
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  return fd;
+}
+
+/**
+ * @brief  Runs a command in-process and collects what it writes to standard
+ *         output, with newlines turned into spaces so the result splits into
+ *         words and trailing newlines removed
+ * @param  Command to run
+ * @param  Buffer receiving the output
+ * @param  Size of the buffer
+ * @return Number of bytes of output, or -1 on error
+ */
+ssize_t capture_output(const char* command, char* out, size_t size) {
+  char line[EXPANDED_SIZE];
+  ssize_t length;
+  int fd;
+
+  if (capture_depth == MAX_SUBSTITUTION_DEPTH) {
+    fprintf(stderr, "myshell: Substitutions nested too deeply\n");
+    return -1;
+  }
+  // Inner substitutions run first and use this level's capture file
+  if (expand_substitutions(command, line, sizeof(line)) == -1 ||
+      (fd = run_captured(line)) == -1)
+    return -1;
+
+  length = pread(fd, out, size - 1, 0);
+  if (length < 0)
+    return -1;
+  while (length > 0 && out[length - 1] == '\n')
+    length--;
+  for (ssize_t i = 0; i < length; i++)
+    if (out[i] == '\n')
+      out[i] = ' ';
+  return length;
+}
+
+/**
+ * @brief  Redraws the lines of the watch screen that differ from what is
+ *         already shown. Output past the width or height of the terminal is
+ *         cut off.
+ * @param  Output of the command
+ * @param  Length of the output
+ * @param  Lines currently on screen below the header; updated
+ * @param  Number of lines available below the header
+ * @param  Width of the terminal
+ */
+void redraw_changed(const char* output, size_t length, char** shown, int rows, int columns) {
+  const char* line = output;
+  const char* end = output + length;
+
+  for (int row = 0; row < rows; row++) {
+    const char* newline = line < end ? memchr(line, '\n', end - line) : NULL;
+    size_t width = line < end ? (newline ? newline : end) - line : 0;
+    const char* text = line < end ? line : "";
+
+    if (width > (size_t) columns)
+      width = columns;
+    // A fresh screen is already blank
+    if (shown[row] == NULL && width == 0)
+      shown[row] = strdup("");
+    else if (shown[row] == NULL || strlen(shown[row]) != width ||
+             memcmp(shown[row], text, width)) {
+      char position[24];
+      int size = snprintf(position, sizeof(position), "\033[%d;1H", row + 3);
+
+      out_write(position, size);
+      out_write(text, width);
+      out_write("\033[K", 3);
+      free(shown[row]);
+      shown[row] = strndup(text, width);
+    }
+    line = newline ? newline + 1 : end;
+  }
+}
+
+/**
+ * @brief  Reruns a command and shows its output full screen, every few
+ *         seconds or whenever one of the named paths changes, until q is
+ *         pressed. Only lines whose text changed are redrawn, so an
+ *         unchanged listing costs no terminal output, and with --on alone
+ *         nothing at all runs until inotify reports a change.
+ * @param  Argument count
+ * @param  Arguments: [-n seconds] [--on path]... command...
+ * @return -1 on error, 0 on success
+ */
+int do_watch(int argc, char** argv) {
+  const char* paths[WATCH_MAX_PATHS];
+  char command[EXPANDED_SIZE];
+  char line[EXPANDED_SIZE];
+  char** shown = NULL;
+  struct termios saved, raw;
+  struct winsize window = {0};
+  int interval = -1, path_count = 0, notify = -1, used = 0, rows = 0;
+  int first;
+
+  for (first = 1; first < argc && argv[first][0] == '-'; first += 2) {
+    if (first + 1 == argc)
+      break;
+    if (!strcmp(argv[first], "-n") && (interval = atoi(argv[first + 1])) > 0)
+      continue;
+    if (!strcmp(argv[first], "--on") && path_count < WATCH_MAX_PATHS) {
+      paths[path_count++] = argv[first + 1];
+      continue;
+    }
+    break;
+  }
+  if (first >= argc || (first < argc && argv[first][0] == '-')) {
+    fprintf(stderr, "watch: Usage: watch [-n seconds] [--on path]... command...\n");
+    return -1;
+  }
+  if (interval == -1 && path_count == 0)
+    interval = 2;
+  for (int i = first; i < argc; i++)
+    used += snprintf(command + used, sizeof(command) - used, "%s%s",
+                     i > first ? " " : "", argv[i]);
+
+  if (path_count > 0) {
+    if ((notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1) {
+      fprintf(stderr, "watch: Cannot start inotify. %s.\n", strerror(errno));
+      return -1;
+    }
+    for (int i = 0; i < path_count; i++)
+      if (inotify_add_watch(notify, paths[i], IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                            IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+        fprintf(stderr, "watch: Cannot watch %s. %s.\n", paths[i], strerror(errno));
+        close(notify);
+        return -1;
+      }
+  }
+
+  // Without a terminal to draw on, run the command once
+  if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+    if (notify != -1)
+      close(notify);
+    snprintf(line, sizeof(line), "%s", command);
+    return execute_command(line);
+  }
+
+  fflush(stdout);
+  out_flush();
+  tcgetattr(STDIN_FILENO, &saved);
+  raw = saved;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+  while (true) {
+    struct pollfd waits[2] = { { .fd = STDIN_FILENO, .events = POLLIN },
+                               { .fd = notify, .events = POLLIN } };
+    struct winsize now = { .ws_row = 24, .ws_col = 80 };
+    struct stat stats;
+    char header[32];
+    char* output;
+    char key;
+    int fd, size;
+
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &now);
+    if (now.ws_row != window.ws_row || now.ws_col != window.ws_col) {
+      // Start over on a fresh screen when the terminal changes size
+      for (int i = 0; i < rows; i++)
+        free(shown[i]);
+      free(shown);
+      window = now;
+      rows = window.ws_row > 2 ? window.ws_row - 2 : 0;
+      shown = calloc(rows ? rows : 1, sizeof(*shown));
+      size = interval > 0 ? snprintf(header, sizeof(header), "Every %ds: ", interval)
+                          : snprintf(header, sizeof(header), "On change: ");
+      out_write("\033[H\033[2J", 7);
+      out_write(header, size);
+      out_write(command, strnlen(command, window.ws_col > size ? window.ws_col - size : 0));
+    }
+
+    invalidate_metadata();
+    snprintf(line, sizeof(line), "%s", command);
+    if ((fd = run_captured(line)) == -1 || fstat(fd, &stats) == -1)
+      break;
+    output = stats.st_size ? mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0) : "";
+    if (output == MAP_FAILED)
+      break;
+    redraw_changed(output, stats.st_size, shown, rows, window.ws_col);
+    if (stats.st_size)
+      munmap(output, stats.st_size);
+    out_write("\033[2;1H", 6);
+    out_flush();
+
+    if (poll(waits, notify == -1 ? 1 : 2, interval > 0 ? interval * 1000 : -1) == -1 &&
+        errno != EINTR)
+      break;
+    if ((waits[0].revents & POLLIN) && (read(STDIN_FILENO, &key, 1) != 1 || key == 'q'))
+      break;
+    if (waits[1].revents & POLLIN) {
+      char events[4096];
+
+      // Let a burst of changes settle, then take them all as one
+      poll(NULL, 0, WATCH_SETTLE_MS);
+      while (read(notify, events, sizeof(events)) > 0)
+        ;
+    }
+  }
+
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+  printf("\033[%d;1H\n", window.ws_row);
+  for (int i = 0; i < rows; i++)
+    free(shown[i]);
+  free(shown);
+  if (notify != -1)
+    close(notify);
+  return 0;
+}
+
+/**
+ * @brief  Replaces each $(command) in a command line with the output of the
+ *         command. Substitutions may be nested.
+ * @param  Command line to expand
+ * @param  Buffer receiving the expanded line
+ * @param  Size of the buffer
+ * @return -1 on error, 0 on success
+ */
+int expand_substitutions(const char* line, char* out, size_t size) {
+  size_t used = 0;
+
+  while (*line != 0 && used < size - 1) {
+    if (line[0] == '$' && line[1] == '(') {
+      char command[EXPANDED_SIZE];
+      const char* end = line + 2;
+      ssize_t length;
+      int depth = 1;
+
+      // Find the matching parenthesis, skipping over nested substitutions
+      for (; *end != 0; end++)
+        if (*end == '(')
+          depth++;
+        else if (*end == ')' && --depth == 0)
+          break;
+      if (*end == 0) {
+        fprintf(stderr, "myshell: Unmatched $(\n");
+        return -1;
+      }
+      snprintf(command, sizeof(command), "%.*s", (int) (end - line - 2), line + 2);
+      if ((length = capture_output(command, out + used, size - used)) == -1)
+        return -1;
+      used += length;
+      line = end + 1;
+    } else
+      out[used++] = *line++;
+  }
+  out[used] = 0;
+  return 0;
+}
+
+/**
+ * @brief  Main program function
+ * @param  Not used
+ * @return EXIT_SUCCESS is always returned
+ */
+int main(int argc, char** argv) {
+  struct timespec start, end;
+  int status;
+
+  atexit(out_flush);
+
+  while (true) {
+    display_prompt();
+    
+    // Read a line representing a command to execute from stdin into 
+    // a character array
+    char* line = fgets(buffer, BUFFER_SIZE, stdin);
+
+    pthread_mutex_lock(&prompt_lock);
+    waiting_for_input = false;
+    pthread_mutex_unlock(&prompt_lock);
+
+    if (line != 0) {
+      
+      // Clean up sloppy user input
+      strip_trailing_whitespace(buffer);
+      
+      //Reset filename buffer after each command execution
+      bzero(filename, MAX_FILENAME_LENGTH);     
+      invalidate_metadata();
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      
+      // Definitions keep their substitutions for when they are called;
+      // cd and exit are ordinary builtins
+      if (is_definition(buffer))
+	status = execute_command(buffer);
+      else if (expand_substitutions(buffer, expanded, EXPANDED_SIZE) == -1)
+	status = -1;
+      else 
+	status = execute_command(expanded);
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      pthread_mutex_lock(&prompt_lock);
+      last_status = status;
+      last_duration_ms = (end.tv_sec - start.tv_sec) * 1000 +
+                         (end.tv_nsec - start.tv_nsec) / 1000000;
+      pthread_mutex_unlock(&prompt_lock);
+    }
+    // Standard input is exhausted, e.g. after tee consumed the rest of it
+    else if (feof(stdin))
+      exit(EXIT_SUCCESS);
+  }
+  
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief  Changes the current working directory
+ * @param  Char array representing the directory to change to, or if empty
+ *         use the user's home directory
+ * @return -1 on error, 0 on success
+ */
+int do_cd(char* dirname) {
+  struct passwd *p = getpwuid(getuid());
+
+  // If no argument, change to current user's home directory
+  if (strnlen(dirname, MAX_PATH_LENGTH) == 0)
+      strncpy(dirname, p->pw_dir, MAX_PATH_LENGTH);
+
+  // Otherwise, change to directory specified and check for error
+  invalidate_metadata();
+  if (chdir(dirname) < 0) {
+    fprintf(stderr, "cd: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief  Opens a descriptor for the current working directory and records
+ *         it, along with its path, in a directory stack entry
+ * @param  Entry to fill in
+ * @return -1 on error, 0 on success
+ */
+int save_cwd(struct dir_entry* entry) {
+  entry->fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (entry->fd == -1)
+    return -1;
+
+  if (getcwd(entry->path, sizeof(entry->path)) == NULL)
+    snprintf(entry->path, sizeof(entry->path), "?");
+  return 0;
+}
+
+/**
+ * @brief  Saves the current working directory on the directory stack and
+ *         changes to a new one. With no argument, exchanges the current
+ *         directory with the one on top of the stack.
+ * @param  Directory to change to, or empty to swap with the top of the stack
+ * @return -1 on error, 0 on success
+ */
+int do_pushd(const char* dirname) {
+  struct dir_entry cwd;
+
+  if (strnlen(dirname, MAX_PATH_LENGTH) == 0 && dir_stack_top == 0) {
+    fprintf(stderr, "pushd: No other directory\n");
+    return -1;
+  }
+  if (strnlen(dirname, MAX_PATH_LENGTH) != 0 && dir_stack_top == DIR_STACK_SIZE) {
+    fprintf(stderr, "pushd: Directory stack full\n");
+    return -1;
+  }
+  if (save_cwd(&cwd) == -1) {
+    fprintf(stderr, "pushd: Cannot open current directory. %s.\n", strerror(errno));
+    return -1;
+  }
+  invalidate_metadata();
+
+  // Swap with the top of the stack using the held descriptor
+  if (strnlen(dirname, MAX_PATH_LENGTH) == 0) {
+    struct dir_entry* top = &dir_stack[dir_stack_top - 1];
+    if (fchdir(top->fd) == -1) {
+      fprintf(stderr, "pushd: %s: %s\n", top->path, strerror(errno));
+      close(cwd.fd);
+      return -1;
+    }
+    close(top->fd);
+    *top = cwd;
+    return 0;
+  }
+
+  if (chdir(dirname) == -1) {
+    fprintf(stderr, "pushd: %s: %s\n", dirname, strerror(errno));
+    close(cwd.fd);
+    return -1;
+  }
+  dir_stack[dir_stack_top++] = cwd;
+  return 0;
+}
+
+/**
+ * @brief  Returns to the directory on top of the directory stack and removes
+ *         it from the stack. The entry is dropped even if it can no longer
+ *         be entered, so a deleted directory does not jam the stack.
+ * @return -1 on error, 0 on success
+ */
+int do_popd(void) {
+  struct dir_entry* top;
+  int result = 0;
+
+  if (dir_stack_top == 0) {
+    fprintf(stderr, "popd: Directory stack empty\n");
+    return -1;
+  }
+  top = &dir_stack[--dir_stack_top];
+  invalidate_metadata();
+  if (fchdir(top->fd) == -1) {
+    fprintf(stderr, "popd: %s: %s\n", top->path, strerror(errno));
+    result = -1;
+  }
+  close(top->fd);
+  return result;
+}
+
+/**
+ * @brief  Outputs the directory stack, starting with the current directory
+ *         followed by the most recently pushed entry
+ * @return Always returns 0
+ */
+int do_dirs(void) {
+  char current_dir[MAX_PATH_LENGTH];
+
+  if (getcwd(current_dir, sizeof(current_dir)) == NULL)
+    snprintf(current_dir, sizeof(current_dir), "?");
+  printf("%s", current_dir);
+  for (int i = dir_stack_top - 1; i >= 0; i--)
+    printf(" %s", dir_stack[i].path);
+  printf("\n");
+  return 0;
+}
+
+/**
+ * @brief  Hashes an extension for the color table, ignoring ASCII case
+ * @param  Extension, starting with its dot
+ * @param  Length of the extension
+ * @return Hash
+ */
+unsigned int color_hash(const char* key, size_t length) {
+  unsigned int hash = 2166136261u;
+
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char) tolower((unsigned char) key[i])) * 16777619u;
+  return hash;
+}
+
+/**
+ * @brief  Parses LS_COLORS, or a small default set if it is unset, into the
+ *         color tables. Runs once; the parsed copy is kept for good.
+ */
+void load_colors(void) {
+  static const char* types[] = { "di", "ln", "pi", "so", "bd", "cd", "ex", "fi" };
+  const char* variable = getenv("LS_COLORS");
+  char* position;
+  char* copy;
+
+  copy = strdup(variable && *variable ? variable
+                : "di=01;34:ln=01;36:pi=40;33:so=01;35:bd=40;33;01:cd=40;33;01:ex=01;32");
+  if (copy == NULL)
+    return;
+  for (char* item = strtok_r(copy, ":", &position); item != NULL;
+       item = strtok_r(NULL, ":", &position)) {
+    char* sequence = strchr(item, '=');
+
+    if (sequence == NULL || sequence[1] == 0)
+      continue;
+    *sequence++ = 0;
+    if (item[0] == '*' && item[1] == '.') {
+      size_t length = strlen(item + 1);
+      unsigned int slot = color_hash(item + 1, length) & (COLOR_TABLE_SIZE - 1);
+
+      // Later entries replace earlier ones, as in dircolors output
+      while (color_table[slot].key != NULL &&
+             (color_table[slot].length != length ||
+              strncasecmp(color_table[slot].key, item + 1, length)))
+        slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+      if (color_table[slot].key == NULL) {
+        // Keep probes short by leaving a quarter of the table empty
+        if (color_count == COLOR_TABLE_SIZE * 3 / 4)
+          continue;
+        color_count++;
+      }
+      color_table[slot] = (struct color_entry) { item + 1, length, sequence };
+    } else if (item[0] == '*' && color_suffix_count < 16) {
+      color_suffixes[color_suffix_count++] =
+        (struct color_entry) { item + 1, strlen(item + 1), sequence };
+    } else {
+      for (int i = 0; i < 8; i++)
+        if (!strcmp(item, types[i]))
+          type_colors[i] = sequence;
+    }
+  }
+}
+
+/**
+ * @brief  Finds the color for a name from its extension or suffix. Each
+ *         dot in the name is tried from the first, so ".tar.gz" wins over
+ *         ".gz".
+ * @param  Name of the entry
+ * @return Escape sequence parameters, or NULL if none apply
+ */
+const char* color_for_name(const char* name) {
+  size_t length = strlen(name);
+
+  for (const char* dot = strchr(name + 1, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+    size_t key = length - (dot - name);
+    unsigned int slot = color_hash(dot, key) & (COLOR_TABLE_SIZE - 1);
+
+    for (; color_table[slot].key != NULL; slot = (slot + 1) & (COLOR_TABLE_SIZE - 1))
+      if (color_table[slot].length == key && !strncasecmp(color_table[slot].key, dot, key))
+        return color_table[slot].sequence;
+  }
+  for (int i = 0; i < color_suffix_count; i++)
+    if (color_suffixes[i].length <= length &&
+        !memcmp(name + length - color_suffixes[i].length, color_suffixes[i].key,
+                color_suffixes[i].length))
+      return color_suffixes[i].sequence;
+  return NULL;
+}
+
+/**
+ * @brief  Picks the color of a directory entry. The type comes from d_type
+ *         where the filesystem provides it; a regular file is only
+ *         examined with fstatat, to see if it is executable, when its name
+ *         has no color of its own.
+ * @param  Open directory
+ * @param  Entry
+ * @return Escape sequence parameters, or NULL for no color
+ */
+const char* color_for_entry(DIR* dir, const struct dirent* d) {
+  unsigned char type = d->d_type;
+  const char* color;
+  struct stat stats;
+  bool executable = false;
+
+  if (type == DT_UNKNOWN || (type == DT_REG && type_colors[6] != NULL &&
+                             color_for_name(d->d_name) == NULL)) {
+    if (fstatat(dirfd(dir), d->d_name, &stats, AT_SYMLINK_NOFOLLOW) == -1)
+      return NULL;
+    type = IFTODT(stats.st_mode);
+    executable = S_ISREG(stats.st_mode) && (stats.st_mode & 0111);
+  }
+  switch (type) {
+  case DT_DIR:  return type_colors[0];
+  case DT_LNK:  return type_colors[1];
+  case DT_FIFO: return type_colors[2];
+  case DT_SOCK: return type_colors[3];
+  case DT_BLK:  return type_colors[4];
+  case DT_CHR:  return type_colors[5];
+  }
+  if (executable && type_colors[6] != NULL)
+    return type_colors[6];
+  return (color = color_for_name(d->d_name)) != NULL ? color : type_colors[7];
+}
+
+/**
+ * @brief  Lists the contents of a directory
+ * @param  Name of directory to list, or if empty, use current working directory
+ * @return -1 on error, 0 on success
+ */ 
+int do_ls(const char* dirname) {
+  struct dirent* d;
+  DIR* dir = opendir(dirname);
+  if(dir == NULL){
+    fprintf(stderr, "ls: %s\n", strerror(errno));
+    return -1;
+  }
+  errno = 0;
+  while((d=readdir(dir)) != NULL){
+    if(errno == 0) {
+      const char* color = ls_color ? color_for_entry(dir, d) : NULL;
+      if (color != NULL) {
+        out_write("\033[", 2);
+        out_write(color, strlen(color));
+        out_char('m');
+      }
+      out_write(d->d_name, strlen(d->d_name));
+      if (color != NULL)
+        out_write("\033[0m", 4);
+      out_char('\n');
+    }
+    else{
+      fprintf(stderr, "ls: Cannot read entry from directory... %s\n",strerror(errno));
+      closedir(dir);
+      return -1;
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+/**
+ * @brief  Parses an I/O priority such as "idle", "be:4" or "rt:0"
+ * @param  Text to parse
+ * @return ioprio_set(2) value, or -1 if the text is not a valid priority
+ */
+int parse_ioprio(const char* text) {
+  int level = 4;
+  int class;
+
+  if (!strcmp(text, "idle"))
+    return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+  if (!strncmp(text, "be", 2))
+    class = IOPRIO_CLASS_BE;
+  else if (!strncmp(text, "rt", 2))
+    class = IOPRIO_CLASS_RT;
+  else
+    return -1;
+
+  if (text[2] == ':')
+    level = atoi(text + 3);
+  else if (text[2] != 0)
+    return -1;
+  if (level < 0 || level > 7)
+    return -1;
+  return (class << IOPRIO_CLASS_SHIFT) | level;
+}
+
+/**
+ * @brief  Parses a rate such as "10M" (bytes per second), "500op" (operations
+ *         per second) or both separated by a comma
+ * @param  Text to parse
+ * @param  Throttle receiving the limits
+ * @return -1 on error, 0 on success
+ */
+int parse_rate(const char* text, struct throttle* t) {
+  char list[MAX_FILENAME_LENGTH];
+
+  strncpy(list, text, sizeof(list) - 1);
+  list[sizeof(list) - 1] = 0;
+  for (char* item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    char* unit;
+    double value = strtod(item, &unit);
+
+    if (value <= 0)
+      return -1;
+    if (!strcmp(unit, "op"))
+      t->ops_per_sec = value;
+    else if (!strcmp(unit, "") || !strcmp(unit, "K") || !strcmp(unit, "M") ||
+             !strcmp(unit, "G"))
+      t->bytes_per_sec = value * (unit[0] == 'K' ? 1 << 10 :
+                                  unit[0] == 'M' ? 1 << 20 :
+                                  unit[0] == 'G' ? 1 << 30 : 1);
+    else
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Removes --ioprio and --rate options from an argument vector,
+ *         applying them on top of the shell-wide default throttle
+ * @param  Argument count, updated to exclude the options
+ * @param  Argument vector, compacted in place
+ * @param  Throttle receiving the result
+ * @return -1 on error, 0 on success
+ */
+int parse_throttle(int* argc, char** argv, struct throttle* t) {
+  int kept = 1;
+
+  *t = default_throttle;
+  for (int i = 1; i < *argc; i++) {
+    if (!strcmp(argv[i], "--ioprio") && i + 1 < *argc) {
+      if ((t->ioprio = parse_ioprio(argv[++i])) == -1) {
+        fprintf(stderr, "%s: Invalid I/O priority \"%s\"\n", argv[0], argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--rate") && i + 1 < *argc) {
+      if (parse_rate(argv[++i], t) == -1) {
+        fprintf(stderr, "%s: Invalid rate \"%s\"\n", argv[0], argv[i]);
+        return -1;
+      }
+    } else
+      argv[kept++] = argv[i];
+  }
+  *argc = kept;
+  argv[kept] = NULL;
+  return 0;
+}
+
+/**
+ * @brief  Applies an I/O priority to the calling thread
+ * @param  ioprio_set(2) value, or 0 to leave the priority unchanged
+ * @return The previous priority, so it can be restored afterwards
+ */
+int set_ioprio(int ioprio) {
+  int previous = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+  if (ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1)
+    fprintf(stderr, "myshell: Cannot set I/O priority. %s.\n", strerror(errno));
+  return previous;
+}
+
+/**
+ * @brief  Makes a throttle the one in effect for the next command and resets
+ *         the token buckets
+ * @param  Throttle to apply
+ * @return The previous I/O priority of the calling thread
+ */
+int begin_throttle(const struct throttle* t) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  active_throttle = *t;
+  byte_bucket.tokens = t->bytes_per_sec;
+  byte_bucket.last = now;
+  op_bucket.tokens = t->ops_per_sec;
+  op_bucket.last = now;
+  return set_ioprio(t->ioprio);
+}
+
+/**
+ * @brief  Clears the throttle in effect and restores the I/O priority
+ * @param  Priority returned by begin_throttle
+ */
+void end_throttle(int ioprio) {
+  if (active_throttle.ioprio != 0 && ioprio != -1)
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+  memset(&active_throttle, 0, sizeof(active_throttle));
+}
+
+/**
+ * @brief  Takes tokens from a bucket, sleeping for as long as the bucket is
+ *         overdrawn. The bucket refills at the given rate up to one second's
+ *         worth of tokens.
+ * @param  Bucket to draw from
+ * @param  Tokens needed
+ * @param  Refill rate in tokens per second, or 0 for no limit
+ */
+void take_tokens(struct token_bucket* bucket, double amount, double rate) {
+  struct timespec now;
+  double wait;
+
+  if (rate <= 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&bucket->lock);
+  bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) +
+                     (now.tv_nsec - bucket->last.tv_nsec) / 1e9) * rate;
+  if (bucket->tokens > rate)
+    bucket->tokens = rate;
+  bucket->last = now;
+  bucket->tokens -= amount;
+  wait = bucket->tokens < 0 ? -bucket->tokens / rate : 0;
+  pthread_mutex_unlock(&bucket->lock);
+
+  if (wait > 0) {
+    struct timespec pause = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+    nanosleep(&pause, NULL);
+  }
+}
+
+/**
+ * @brief  Accounts for I/O about to be issued under the active throttle
+ * @param  Number of bytes, or 0 for a metadata operation
+ */
+void throttle_io(size_t bytes) {
+  take_tokens(&op_bucket, 1, active_throttle.ops_per_sec);
+  if (bytes > 0)
+    take_tokens(&byte_bucket, bytes, active_throttle.bytes_per_sec);
+}
+
+/**
+ * @brief  Outputs the contents of a single ordinary file
+ * @param  Name of file whose contents should be output
+ * @return -1 on error, 0 on success
+ */
+int do_cat(const char* filename) {
+  ssize_t bytesRead;
+  int fd = open(filename, O_RDONLY);
+
+  if(fd == -1){
+    close(fd);
+    fprintf(stderr, "cat: Cannot open file. %s\n",strerror(errno));
+    return fd;
+  }
+  throttle_io(BUFFER_SIZE);
+  while( (bytesRead = read(fd, buffer, BUFFER_SIZE)) != 0){
+    if(bytesRead == -1 || write(1, buffer, bytesRead) != bytesRead) {
+      close(fd);
+      fprintf(stderr, "cat: cannot read file. %s\n",strerror(errno));
+      return -1;
+    }
+    printf("\n");
+    throttle_io(BUFFER_SIZE);
+  }
+  close(fd);
+  return 0;
+}
+
+/**
+ * @brief  Remembers the filesystem a path lives on so it can be flushed
+ *         with syncfs once too many paths were modified to fsync each one.
+ *         If there are too many filesystems as well, everything is synced.
+ * @param  Path on the filesystem
+ */
+void durable_add_device(const char* path) {
+  struct stat stats;
+
+  if (stat(path, &stats) == -1)
+    return;
+  for (int i = 0; i < durable_device_count; i++)
+    if (durable_devices[i] == stats.st_dev)
+      return;
+  if (durable_device_count < DURABLE_MAX_PATHS)
+    durable_devices[durable_device_count++] = stats.st_dev;
+  else
+    durable_sync_all = true;
+}
+
+/**
+ * @brief  Records a path modified by a --durable command. Repeated paths,
+ *         typically the shared parent directory, are only recorded once.
+ * @param  Path that was created or changed
+ */
+void durable_add(const char* path) {
+  if (!durable)
+    return;
+  for (int i = 0; i < durable_count; i++)
+    if (!strcmp(durable_paths[i], path))
+      return;
+
+  if (durable_count < DURABLE_MAX_PATHS && !durable_overflow) {
+    snprintf(durable_paths[durable_count++], MAX_PATH_LENGTH, "%s", path);
+    return;
+  }
+  if (!durable_overflow) {
+    durable_overflow = true;
+    for (int i = 0; i < durable_count; i++)
+      durable_add_device(durable_paths[i]);
+  }
+  durable_add_device(path);
+}
+
+/**
+ * @brief  Records the directory holding a path modified by a --durable
+ *         command, since the new or removed entry lives in that directory
+ * @param  Path that was created, renamed or removed
+ */
+void durable_add_parent(const char* path) {
+  char parent[MAX_PATH_LENGTH];
+  const char* slash = strrchr(path, '/');
+
+  if (slash == NULL)
+    durable_add(".");
+  else if (slash == path)
+    durable_add("/");
+  else {
+    snprintf(parent, sizeof(parent), "%.*s", (int) (slash - path), path);
+    durable_add(parent);
+  }
+}
+
+/**
+ * @brief  Makes everything recorded since durable mode was entered reach
+ *         stable storage with one fsync per distinct path, or one syncfs per
+ *         filesystem when there were too many, then leaves durable mode
+ * @param  Name of the command, for error messages
+ * @return -1 on error, 0 on success
+ */
+int durable_commit(const char* command) {
+  int result = 0;
+
+  if (durable_overflow) {
+    for (int i = 0; i < durable_count; i++) {
+      struct stat stats;
+      int fd = open(durable_paths[i], O_RDONLY | O_CLOEXEC);
+
+      // One open path per device is enough to name its filesystem
+      if (fd == -1 || fstat(fd, &stats) == -1) {
+        if (fd != -1)
+          close(fd);
+        continue;
+      }
+      for (int j = 0; j < durable_device_count; j++)
+        if (durable_devices[j] == stats.st_dev) {
+          if (syncfs(fd) == -1)
+            result = -1;
+          durable_devices[j] = durable_devices[--durable_device_count];
+          break;
+        }
+      close(fd);
+    }
+    if (durable_device_count != 0 || durable_sync_all)
+      sync();
+  } else
+    for (int i = 0; i < durable_count; i++) {
+      int fd = open(durable_paths[i], O_RDONLY | O_CLOEXEC);
+      if (fd == -1 || fsync(fd) == -1)
+        result = -1;
+      if (fd != -1)
+        close(fd);
+    }
+
+  if (result == -1)
+    fprintf(stderr, "%s: Cannot flush changes to disk. %s.\n", command, strerror(errno));
+  durable = durable_overflow = durable_sync_all = false;
+  durable_count = durable_device_count = 0;
+  return result;
+}
+
+/**
+ * @brief  Creates a new directory
+ * @param  Name of directory to create
+ * @return -1 on error, 0 on success
+ */
+int do_mkdir(const char* dirname) {
+  int newDir = mkdir(dirname, 0777);
+  if(newDir == -1){
+      fprintf(stderr, "mkdir: Cannot create directory. %s.\n",strerror(errno));
+      return newDir;
+  }
+  durable_add(dirname);
+  durable_add_parent(dirname);
+  return newDir;
+}
+
+/**
+ * @brief  Removes an existing directory
+ * @param  Name of directory to remove
+ * @return -1 on error, 0 on success
+ */
+int do_rmdir(const char* dirname) {
+  if(rmdir(dirname) == -1){
+    fprintf(stderr, "rmdir: Cannot remove directory. %s.\n",strerror(errno));
+    return -1;
+  }
+  else return 0;
+}
+
+/**
+ * @brief  Outputs the name of the current working directory
+ * @return Cannot fail. Always returns 1.
+ */
+int do_pwd(void) {
+  char current_dir[MAX_PATH_LENGTH];
+  if(getcwd(current_dir, sizeof(current_dir)) == NULL){
+    fprintf(stderr, "pwd: Could not find current directory. %s.\n",strerror(errno));
+  }
+  printf("%s\n", current_dir);
+  return 1;
+}
+
+/**
+ * @brief  Shrinks an open file TRUNCATE_STEP bytes at a time, pausing
+ *         between steps so the filesystem can serve other I/O while the
+ *         extents are freed, then closes it
+ * @param  Descriptor of the file, which has already been unlinked
+ * @param  Throttle to follow
+ * @param  Bucket to draw operations from
+ */
+void truncate_in_steps(int fd, const struct throttle* t, struct token_bucket* ops) {
+  struct timespec pause = { 0, TRUNCATE_PAUSE_MS * 1000000L };
+  struct stat stats;
+  off_t size;
+
+  if (fstat(fd, &stats) == 0)
+    for (size = stats.st_size; size > TRUNCATE_STEP; ) {
+      size -= TRUNCATE_STEP;
+      take_tokens(ops, 1, t->ops_per_sec);
+      if (ftruncate(fd, size) == -1)
+        break;
+      nanosleep(&pause, NULL);
+    }
+  close(fd);
+}
+
+/**
+ * @brief  Background job releasing the space of an unlinked file
+ * @param  The truncate_job, freed when done
+ * @return Always NULL
+ */
+void* truncate_worker(void* arg) {
+  struct truncate_job* job = arg;
+
+  set_ioprio(job->throttle.ioprio);
+  truncate_in_steps(job->fd, &job->throttle, &job->ops);
+  pthread_mutex_destroy(&job->ops.lock);
+  free(job);
+  atomic_fetch_sub(&active_jobs, 1);
+  return NULL;
+}
+
+/**
+ * @brief  Removes a file, releasing the space of a large one gradually.
+ *         The name is unlinked right away while an open descriptor keeps
+ *         the data alive, and the file is then truncated in steps so no
+ *         single operation has to free hundreds of gigabytes of extents.
+ *         Files with other hard links are simply unlinked, and so are files
+ *         that cannot be opened for writing, with a warning if they are large.
+ * @param  Directory containing the file
+ * @param  Name of the file
+ * @param  Whether to do the truncation on a background job
+ * @return -1 on error, 0 on success
+ */
+int remove_gradually(int dirfd, const char* name, bool background) {
+  struct truncate_job* job;
+  struct stat stats;
+  pthread_t worker;
+  int fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  int error = errno;
+
+  if (fd != -1 && (fstat(fd, &stats) == -1 || !S_ISREG(stats.st_mode) ||
+                   stats.st_nlink > 1 || stats.st_size < TRUNCATE_THRESHOLD)) {
+    close(fd);
+    fd = -1;
+  } else if (fd == -1 && error != ENOENT &&
+             fstatat(dirfd, name, &stats, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(stats.st_mode) &&
+             stats.st_nlink == 1 && stats.st_size >= TRUNCATE_THRESHOLD)
+    fprintf(stderr, "rm: Cannot open %s to release it gradually, removing it at once. %s.\n",
+            name, strerror(error));
+  if (unlinkat(dirfd, name, 0) == -1) {
+    fprintf(stderr, "rm: Cannot remove %s. %s.\n", name, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  if (fd == -1)
+    return 0;
+
+  if (background && (job = malloc(sizeof(*job))) != NULL) {
+    job->fd = fd;
+    job->throttle = active_throttle;
+    job->ops.tokens = active_throttle.ops_per_sec;
+    clock_gettime(CLOCK_MONOTONIC, &job->ops.last);
+    pthread_mutex_init(&job->ops.lock, NULL);
+    atomic_fetch_add(&active_jobs, 1);
+    if (pthread_create(&worker, NULL, truncate_worker, job) == 0) {
+      pthread_detach(worker);
+      return 0;
+    }
+    atomic_fetch_sub(&active_jobs, 1);
+    pthread_mutex_destroy(&job->ops.lock);
+    free(job);
+  }
+  truncate_in_steps(fd, &active_throttle, &op_bucket);
+  return 0;
+}
+
+/**
+ * @brief  Removes (unlinks) a file
+ * @param  Name of file to delete
+ * @return -1 on error, 0 on success
+ */
+int do_rm(const char* filename) {
+  if (gradual_delete != GRADUAL_OFF)
+    return remove_gradually(AT_FDCWD, filename, gradual_delete == GRADUAL_BACKGROUND);
+
+  int rm = unlink(filename);
+  if(rm == -1){
+    fprintf(stderr, "rm: Cannot remove file. %s.\n",strerror(errno));
+    return rm;
+  }
+  return rm;
+}
+
+/**
+ * @brief  Outputs information about a file
+ * @param  Name of file to stat
+ * @return -1 on error, 0 on success
+ */
+int do_stat(char* filename) {
+  struct stat stats;
+  int result = stat(filename, &stats);
+  if(result == -1){
+    fprintf(stderr, "stat: Cannot retrieve file stats. %s.\n",strerror(errno));
+    return result;
+  }
+  printf("\nSTATS FOR \"%s\":\n", filename);
+  printf("Last access: %ld ns\n", stats.st_atime);
+  printf("Last modification: %ld ns\n", stats.st_mtime);
+  printf("Last change: %ld ns\n\n", stats.st_ctime);
+
+  printf("File owner ID: %d\nFile group owner ID: %d\n", stats.st_uid, stats.st_gid);
+  printf("File inode number: %ld\n", stats.st_ino);
+  printf("File type & mode: %d\n", stats.st_mode);
+  printf("File hard link count: %ld\n\n", stats.st_nlink);
+
+  printf("File size: %ld byte(s)\n", stats.st_size);
+  printf("File preferred block size: %ld\n", stats.st_blksize);
+  printf("Allocated %ld blocks of 512 bytes\n\n", stats.st_blocks);
+  
+  return result;
+}
+
+/**
+ * @brief  Reads the "some avg10" figure from a pressure stall information
+ *         file, the share of the last ten seconds in which at least one task
+ *         was stalled on the resource
+ * @param  Path of the file under /proc/pressure
+ * @return Percentage stalled, or 0 if PSI is unavailable
+ */
+double read_pressure(const char* path) {
+  char text[BUFFER_SIZE];
+  ssize_t length;
+  char* field;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1)
+    return 0;
+  length = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (length <= 0)
+    return 0;
+  text[length] = 0;
+  if ((field = strstr(text, "some avg10=")) == NULL)
+    return 0;
+  return strtod(field + 11, NULL);
+}
+
+/**
+ * @brief  Waits until the governor allows another operation to start
+ */
+void governor_acquire(void) {
+  pthread_mutex_lock(&governor.lock);
+  while (governor.active >= governor.limit)
+    pthread_cond_wait(&governor.slot, &governor.lock);
+  governor.active++;
+  pthread_mutex_unlock(&governor.lock);
+}
+
+/**
+ * @brief  Records a finished operation and, at most once per
+ *         GOVERNOR_INTERVAL_MS, adjusts the concurrency limit from the
+ *         observed latency and the io/memory pressure stall figures
+ * @param  How long the operation took, in microseconds
+ */
+void governor_release(double latency_us) {
+  struct timespec now;
+  bool adjust;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&governor.lock);
+  governor.active--;
+  governor.latency_us += (latency_us - governor.latency_us) / 8;
+  if (governor.baseline_us == 0 || governor.latency_us < governor.baseline_us)
+    governor.baseline_us = governor.latency_us;
+  else
+    // Let the baseline drift up slowly so one lucky sample can't pin it
+    governor.baseline_us += (governor.latency_us - governor.baseline_us) / 256;
+
+  adjust = (now.tv_sec - governor.last_adjust.tv_sec) * 1000 +
+           (now.tv_nsec - governor.last_adjust.tv_nsec) / 1000000 >=
+           GOVERNOR_INTERVAL_MS;
+  if (adjust)
+    governor.last_adjust = now;
+  pthread_mutex_unlock(&governor.lock);
+
+  if (adjust) {
+    bool saturated = read_pressure("/proc/pressure/io") > PSI_LIMIT ||
+                     read_pressure("/proc/pressure/memory") > PSI_LIMIT;
+
+    pthread_mutex_lock(&governor.lock);
+    if (saturated || governor.latency_us > LATENCY_LIMIT * governor.baseline_us)
+      governor.limit = governor.limit / 2 > MIN_WORKERS ? governor.limit / 2 : MIN_WORKERS;
+    else if (governor.active + 1 >= governor.limit && governor.limit < MAX_WORKERS)
+      governor.limit++;
+    pthread_mutex_unlock(&governor.lock);
+  }
+  pthread_cond_broadcast(&governor.slot);
+}
+
+/**
+ * @brief  Worker loop for run_batch. Takes the next unclaimed name and runs
+ *         the batch operation on it once the governor grants a slot.
+ * @param  The batch being processed
+ * @return Always NULL
+ */
+void* batch_worker(void* arg) {
+  struct batch* b = arg;
+  struct timespec start, end;
+  int i;
+
+  set_ioprio(active_throttle.ioprio);
+  while ((i = atomic_fetch_add(&b->next, 1)) < b->count) {
+    throttle_io(0);
+    governor_acquire();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (b->op(b->dirfd, b->entries[i].name, b->arg) == -1)
+      atomic_fetch_add(&b->failures, 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    governor_release((end.tv_sec - start.tv_sec) * 1e6 +
+                     (end.tv_nsec - start.tv_nsec) / 1e3);
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Thread of the batch pool. Helps with each batch posted until the
+ *         pool is stopped.
+ * @param  Not used
+ * @return Always NULL
+ */
+void* pool_worker(void* arg) {
+  unsigned long seen = 0;
+
+  (void) arg;
+  pthread_mutex_lock(&batch_pool.lock);
+  for (;;) {
+    struct batch* b;
+
+    while (!batch_pool.stop && batch_pool.generation == seen)
+      pthread_cond_wait(&batch_pool.work, &batch_pool.lock);
+    if (batch_pool.stop)
+      break;
+    seen = batch_pool.generation;
+    // A batch that finished before this thread woke up is gone
+    if ((b = batch_pool.batch) == NULL)
+      continue;
+    batch_pool.busy++;
+    pthread_mutex_unlock(&batch_pool.lock);
+    batch_worker(b);
+    pthread_mutex_lock(&batch_pool.lock);
+    if (--batch_pool.busy == 0)
+      pthread_cond_broadcast(&batch_pool.idle);
+  }
+  pthread_mutex_unlock(&batch_pool.lock);
+  return NULL;
+}
+
+/**
+ * @brief  Runs an operation over every name in a batch on the calling
+ *         thread and the batch pool. The pool is grown to as many threads
+ *         as the governor currently allows in flight, up to MAX_WORKERS,
+ *         and the governor decides how many actually run at once.
+ * @param  Batch to process
+ * @return Number of names the operation failed on
+ */
+int run_batch(struct batch* b) {
+  int wanted;
+
+  atomic_store(&b->next, 0);
+  atomic_store(&b->failures, 0);
+  if (b->count < 2) {
+    batch_worker(b);
+    return atomic_load(&b->failures);
+  }
+
+  pthread_mutex_lock(&governor.lock);
+  wanted = governor.limit - 1;
+  pthread_mutex_unlock(&governor.lock);
+  if (wanted > b->count - 1)
+    wanted = b->count - 1;
+  while (batch_pool.count < wanted &&
+         pthread_create(&batch_pool.threads[batch_pool.count], NULL, pool_worker, NULL) == 0)
+    batch_pool.count++;
+
+  pthread_mutex_lock(&batch_pool.lock);
+  batch_pool.batch = b;
+  batch_pool.generation++;
+  pthread_cond_broadcast(&batch_pool.work);
+  pthread_mutex_unlock(&batch_pool.lock);
+
+  batch_worker(b);
+
+  pthread_mutex_lock(&batch_pool.lock);
+  batch_pool.batch = NULL;
+  while (batch_pool.busy > 0)
+    pthread_cond_wait(&batch_pool.idle, &batch_pool.lock);
+  pthread_mutex_unlock(&batch_pool.lock);
+  return atomic_load(&b->failures);
+}
+
+/**
+ * @brief  Stops the threads of the batch pool once a command is done with it
+ */
+void stop_batch_pool(void) {
+  pthread_mutex_lock(&batch_pool.lock);
+  batch_pool.stop = true;
+  pthread_cond_broadcast(&batch_pool.work);
+  pthread_mutex_unlock(&batch_pool.lock);
+  while (batch_pool.count > 0)
+    pthread_join(batch_pool.threads[--batch_pool.count], NULL);
+  batch_pool.stop = false;
+}
+
+/**
+ * @brief  Queues a name in a batch
+ * @param  Batch to add to
+ * @param  Name to copy into the batch
+ * @param  Inode number of the name, or 0 if not known
+ */
+void add_to_batch(struct batch* b, const char* name, ino_t ino) {
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity ? b->capacity * 2 : 64;
+    b->entries = realloc(b->entries, b->capacity * sizeof(struct batch_entry));
+  }
+  b->entries[b->count].name = strdup(name);
+  b->entries[b->count++].ino = ino;
+}
+
+/**
+ * @brief  Releases the names held by a batch
+ * @param  Batch to empty
+ */
+void free_batch(struct batch* b) {
+  for (int i = 0; i < b->count; i++)
+    free(b->entries[i].name);
+  free(b->entries);
+  b->entries = NULL;
+  b->count = b->capacity = 0;
+}
+
+/**
+ * @brief  qsort comparison ordering batch entries by inode number
+ */
+int compare_inodes(const void* a, const void* b) {
+  ino_t x = ((const struct batch_entry*) a)->ino;
+  ino_t y = ((const struct batch_entry*) b)->ino;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief  Gives the length of the directory part of a path, including the
+ *         last slash
+ * @param  Path
+ * @return Length, or 0 for a name in the working directory
+ */
+int parent_length(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash ? slash - path + 1 : 0;
+}
+
+/**
+ * @brief  qsort_r comparison grouping indices of batch entries by the
+ *         directory part of their names
+ */
+int compare_parents(const void* a, const void* b, void* arg) {
+  const struct batch_entry* entries = arg;
+  const char* x = entries[*(const int*) a].name;
+  const char* y = entries[*(const int*) b].name;
+  int length_x = parent_length(x), length_y = parent_length(y);
+  int order = memcmp(x, y, length_x < length_y ? length_x : length_y);
+
+  return order != 0 ? order : length_x - length_y;
+}
+
+/**
+ * @brief  Looks up the inode numbers of batch entries that share a parent
+ *         directory by reading the directory once. The wanted names are
+ *         hashed into an open addressed table, so each directory entry
+ *         costs one probe.
+ * @param  Batch whose entries are paths relative to the working directory
+ * @param  Indices of the entries in the group
+ * @param  Number of entries in the group
+ */
+void scan_inodes(struct batch* b, const int* group, int count) {
+  const char* first = b->entries[group[0]].name;
+  int length = parent_length(first);
+  char parent[MAX_PATH_LENGTH];
+  unsigned int size = 1;
+  struct dirent* d;
+  int* slots;
+  DIR* dir;
+
+  while (size < 2 * (unsigned int) count)
+    size *= 2;
+  if ((slots = calloc(size, sizeof(int))) == NULL)
+    return;
+  // Slots hold entry indices plus one, so that 0 marks an empty slot
+  for (int i = 0; i < count; i++) {
+    unsigned int hash = 2166136261u;
+    for (const char* p = b->entries[group[i]].name + length; *p != 0; p++)
+      hash = (hash ^ (unsigned char) *p) * 16777619u;
+    while (slots[hash & (size - 1)] != 0)
+      hash++;
+    slots[hash & (size - 1)] = group[i] + 1;
+  }
+
+  snprintf(parent, sizeof(parent), "%.*s", length > 1 ? length - 1 : length, first);
+  if ((dir = opendir(length == 0 ? "." : parent)) != NULL) {
+    while ((d = readdir(dir)) != NULL) {
+      unsigned int hash = 2166136261u;
+      for (const char* p = d->d_name; *p != 0; p++)
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+      // The same name may be queued more than once
+      for (; slots[hash & (size - 1)] != 0; hash++) {
+        struct batch_entry* entry = &b->entries[slots[hash & (size - 1)] - 1];
+        if (!strcmp(entry->name + length, d->d_name))
+          entry->ino = d->d_ino;
+      }
+    }
+    closedir(dir);
+  }
+  free(slots);
+}
+
+/**
+ * @brief  Looks up the inode numbers of batch entries named by path. Names
+ *         are grouped by parent directory; a large group reads its
+ *         directory once and takes d_ino from the entries, and a small one
+ *         stats each name rather than read a directory that may be huge.
+ * @param  Batch whose entries are paths relative to the working directory
+ */
+void fill_inodes(struct batch* b) {
+  int* order = malloc(b->count * sizeof(int));
+  struct stat stats;
+  int end;
+
+  if (order == NULL)
+    return;
+  for (int i = 0; i < b->count; i++)
+    order[i] = i;
+  qsort_r(order, b->count, sizeof(int), compare_parents, b->entries);
+
+  for (int start = 0; start < b->count; start = end) {
+    for (end = start + 1; end < b->count &&
+         compare_parents(&order[start], &order[end], b->entries) == 0; end++)
+      ;
+    if (end - start >= INODE_SCAN_MIN)
+      scan_inodes(b, order + start, end - start);
+    else
+      for (int i = start; i < end; i++)
+        if (fstatat(AT_FDCWD, b->entries[order[i]].name, &stats, AT_SYMLINK_NOFOLLOW) == 0)
+          b->entries[order[i]].ino = stats.st_ino;
+  }
+  free(order);
+}
+
+/**
+ * @brief  Sorts a batch by inode number if the running command asked for
+ *         it. Issuing operations in inode order keeps the disk head and the
+ *         ext4 journal moving in one direction instead of seeking in
+ *         directory order.
+ * @param  Batch to sort
+ * @param  Whether the entries still need their inode numbers looked up
+ */
+void order_batch(struct batch* b, bool lookup) {
+  if (!inode_order || b->count < 2)
+    return;
+  if (lookup)
+    fill_inodes(b);
+  qsort(b->entries, b->count, sizeof(struct batch_entry), compare_inodes);
+}
+
+/**
+ * @brief  Unlinks a single non-directory entry for a batch
+ * @param  Directory containing the entry
+ * @param  Name of the entry
+ * @param  Not used
+ * @return -1 on error, 0 on success
+ */
+int unlink_entry(int dirfd, const char* name, void* arg) {
+  (void) arg;
+  if (gradual_delete != GRADUAL_OFF)
+    return remove_gradually(dirfd, name, gradual_delete == GRADUAL_BACKGROUND);
+  if (unlinkat(dirfd, name, 0) == -1) {
+    fprintf(stderr, "rm: Cannot remove %s. %s.\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Removes a directory and everything below it. The files in each
+ *         directory are unlinked in parallel, then its subdirectories are
+ *         descended into one at a time.
+ * @param  Directory holding the tree
+ * @param  Name of the tree to remove
+ * @return -1 on error, 0 on success
+ */
+int remove_tree(int parent, const char* name) {
+  struct batch files = { .op = unlink_entry };
+  struct batch subdirs = {0};
+  struct dirent* d;
+  int result = 0;
+  DIR* dir;
+
+  files.dirfd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (files.dirfd == -1 || (dir = fdopendir(files.dirfd)) == NULL) {
+    fprintf(stderr, "rm: Cannot open %s. %s.\n", name, strerror(errno));
+    if (files.dirfd != -1)
+      close(files.dirfd);
+    return -1;
+  }
+
+  errno = 0;
+  while ((d = readdir(dir)) != NULL) {
+    struct stat stats;
+    bool is_dir = d->d_type == DT_DIR;
+
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+      continue;
+    if (d->d_type == DT_UNKNOWN &&
+        fstatat(files.dirfd, d->d_name, &stats, AT_SYMLINK_NOFOLLOW) == 0)
+      is_dir = S_ISDIR(stats.st_mode);
+
+    add_to_batch(is_dir ? &subdirs : &files, d->d_name, d->d_ino);
+    errno = 0;
+  }
+  if (errno != 0) {
+    fprintf(stderr, "rm: Cannot read entry from directory... %s\n", strerror(errno));
+    result = -1;
+  }
+
+  order_batch(&files, false);
+  if (run_batch(&files) != 0)
+    result = -1;
+  order_batch(&subdirs, false);
+  for (int i = 0; i < subdirs.count; i++)
+    if (remove_tree(files.dirfd, subdirs.entries[i].name) == -1)
+      result = -1;
+  free_batch(&files);
+  free_batch(&subdirs);
+  closedir(dir);
+
+  if (result == 0 && unlinkat(parent, name, AT_REMOVEDIR) == -1) {
+    fprintf(stderr, "rm: Cannot remove directory %s. %s.\n", name, strerror(errno));
+    result = -1;
+  }
+  return result;
+}
+
+/**
+ * @brief  Recursively removes a directory tree
+ * @param  Name of directory to remove
+ * @return -1 on error, 0 on success
+ */
+int do_rm_tree(const char* dirname) {
+  return remove_tree(AT_FDCWD, dirname);
+}
+
+/**
+ * @brief  Runs cat under the I/O priority and rate given by its options
+ * @param  Argument count
+ * @param  Arguments: [--ioprio CLASS] [--rate RATE] file
+ * @return -1 on error, 0 on success
+ */
+int builtin_cat(int argc, char** argv) {
+  struct throttle t;
+  int ioprio, result;
+
+  if (parse_throttle(&argc, argv, &t) == -1)
+    return -1;
+  if (argc != 2) {
+    fprintf(stderr, "cat: Usage: cat [--ioprio CLASS] [--rate RATE] file\n");
+    return -1;
+  }
+  ioprio = begin_throttle(&t);
+  result = do_cat(argv[1]);
+  end_throttle(ioprio);
+  return result;
+}
+
+/**
+ * @brief  Removes a flag such as "--inode-order" from an argument vector
+ * @param  Argument count, updated to exclude the flag
+ * @param  Argument vector, compacted in place
+ * @param  Flag to look for
+ * @return Whether the flag was present
+ */
+bool take_flag(int* argc, char** argv, const char* flag) {
+  int kept = 1;
+  bool found = false;
+
+  for (int i = 1; i < *argc; i++)
+    if (!strcmp(argv[i], flag))
+      found = true;
+    else
+      argv[kept++] = argv[i];
+  *argc = kept;
+  argv[kept] = NULL;
+  return found;
+}
+
+/**
+ * @brief  Runs rm, or rm -r, under the I/O priority and rate given by its
+ *         options. Several files are removed as one parallel batch.
+ *         --gradual releases the space of large files in steps, and --bg
+ *         does so on a background job.
+ * @param  Argument count
+ * @param  Arguments: [-r] [--inode-order] [--gradual] [--bg]
+ *         [--ioprio CLASS] [--rate RATE] name...
+ * @return -1 on error, 0 on success
+ */
+int builtin_rm(int argc, char** argv) {
+  struct batch files = { .dirfd = AT_FDCWD, .op = unlink_entry };
+  struct throttle t;
+  bool recursive = false;
+  int ioprio, result = 0;
+
+  invalidate_metadata();
+  inode_order = take_flag(&argc, argv, "--inode-order");
+  gradual_delete = take_flag(&argc, argv, "--gradual") ? GRADUAL_FOREGROUND : GRADUAL_OFF;
+  if (take_flag(&argc, argv, "--bg"))
+    gradual_delete = GRADUAL_BACKGROUND;
+  if (parse_throttle(&argc, argv, &t) == -1)
+    return -1;
+  if (argc > 1 && !strcmp(argv[1], "-r")) {
+    recursive = true;
+    argv++;
+    argc--;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "rm: Usage: rm [-r] [--inode-order] [--gradual] [--bg] "
+                    "[--ioprio CLASS] [--rate RATE] name...\n");
+    return -1;
+  }
+
+  ioprio = begin_throttle(&t);
+  if (recursive) {
+    for (int i = 1; i < argc; i++)
+      if (do_rm_tree(argv[i]) == -1)
+        result = -1;
+  } else if (argc == 2)
+    result = do_rm(argv[1]);
+  else {
+    for (int i = 1; i < argc; i++)
+      add_to_batch(&files, argv[i], 0);
+    order_batch(&files, true);
+    result = run_batch(&files) == 0 ? 0 : -1;
+    free_batch(&files);
+  }
+  stop_batch_pool();
+  end_throttle(ioprio);
+  return result;
+}
+
+/**
+ * @brief  Outputs information about one or more files
+ * @param  Argument count
+ * @param  Arguments: [--inode-order] name...
+ * @return -1 if any file could not be examined, 0 on success
+ */
+int builtin_stat(int argc, char** argv) {
+  struct batch files = {0};
+  int result = 0;
+
+  inode_order = take_flag(&argc, argv, "--inode-order");
+  if (argc < 2) {
+    fprintf(stderr, "stat: Usage: stat [--inode-order] name...\n");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++)
+    add_to_batch(&files, argv[i], 0);
+  order_batch(&files, true);
+  for (int i = 0; i < files.count; i++)
+    if (do_stat(files.entries[i].name) == -1)
+      result = -1;
+  free_batch(&files);
+  return result;
+}
+
+/**
+ * @brief  Changes the permission bits of a single entry for a batch
+ * @param  Directory containing the entry
+ * @param  Name of the entry
+ * @param  Pointer to the mode to apply
+ * @return -1 on error, 0 on success
+ */
+int chmod_entry(int dirfd, const char* name, void* arg) {
+  if (fchmodat(dirfd, name, *(mode_t*) arg, 0) == -1) {
+    fprintf(stderr, "chmod: Cannot change mode of %s. %s.\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Changes the permission bits of one or more files in parallel
+ * @param  Argument count
+ * @param  Arguments: [--inode-order] octal-mode name...
+ * @return -1 on error, 0 on success
+ */
+int do_chmod(int argc, char** argv) {
+  struct batch files = { .dirfd = AT_FDCWD, .op = chmod_entry };
+  char* end;
+  mode_t mode;
+  int result;
+
+  invalidate_metadata();
+  inode_order = take_flag(&argc, argv, "--inode-order");
+  if (argc < 3) {
+    fprintf(stderr, "chmod: Usage: chmod [--inode-order] octal-mode name...\n");
+    return -1;
+  }
+  mode = strtol(argv[1], &end, 8);
+  if (*end != 0 || mode > 07777) {
+    fprintf(stderr, "chmod: Invalid mode \"%s\"\n", argv[1]);
+    return -1;
+  }
+
+  files.arg = &mode;
+  for (int i = 2; i < argc; i++)
+    add_to_batch(&files, argv[i], 0);
+  order_batch(&files, true);
+  result = run_batch(&files) == 0 ? 0 : -1;
+  stop_batch_pool();
+  free_batch(&files);
+  return result;
+}
+
+/**
+ * @brief  Compiles the signature table into tries, one per offset, so each
+ *         file is matched by a single walk over its first bytes rather than
+ *         a comparison against every signature
+ */
+void build_file_trie(void) {
+  for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++) {
+    const struct signature* signature = &signatures[i];
+    int root, node;
+
+    for (root = 0; root < file_trie_count; root++)
+      if (file_trie_offsets[root] == signature->offset)
+        break;
+    if (root == file_trie_count) {
+      file_trie_offsets[root] = signature->offset;
+      file_trie_roots[root] = file_trie_used++;
+      file_trie_count++;
+    }
+
+    node = file_trie_roots[root];
+    for (int j = 0; j < signature->length; j++) {
+      unsigned char byte = signature->bytes[j];
+      if (file_trie[node].next[byte] == 0)
+        file_trie[node].next[byte] = file_trie_used++;
+      node = file_trie[node].next[byte];
+    }
+    file_trie[node].description = signature->description;
+  }
+}
+
+/**
+ * @brief  Matches the start of a file against the signature tries. The
+ *         longest signature that matches wins, so "#!/bin/sh" is preferred
+ *         over "#!".
+ * @param  First bytes of the file
+ * @param  Number of bytes
+ * @return Description of the match, or NULL if nothing matched
+ */
+const char* match_signature(const unsigned char* head, size_t length) {
+  for (int root = 0; root < file_trie_count; root++) {
+    const char* description = NULL;
+    int node = file_trie_roots[root];
+
+    for (size_t i = file_trie_offsets[root]; i < length && node != 0; i++) {
+      node = file_trie[node].next[head[i]];
+      if (node != 0 && file_trie[node].description != NULL)
+        description = file_trie[node].description;
+    }
+    if (description != NULL)
+      return description;
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Decides whether bytes without a known signature are text
+ * @param  First bytes of the file
+ * @param  Number of bytes
+ * @return Description of the text, or "data"
+ */
+const char* classify_text(const unsigned char* head, size_t length) {
+  bool ascii = true;
+
+  for (size_t i = 0; i < length; i++) {
+    unsigned char byte = head[i];
+    int extra;
+
+    if (byte < 0x80) {
+      if (byte < 0x20 && !strchr("\t\n\r\f\b\033", byte))
+        return "data";
+      continue;
+    }
+    ascii = false;
+    extra = byte >= 0xf0 && byte < 0xf8 ? 3 : byte >= 0xe0 ? 2 : byte >= 0xc2 ? 1 : -1;
+    if (extra < 0 || byte >= 0xf8)
+      return "data";
+    // A sequence cut off by the end of the buffer still counts
+    for (int j = 1; j <= extra && i + j < length; j++)
+      if ((head[i + j] & 0xc0) != 0x80)
+        return "data";
+    i += extra;
+  }
+  return ascii ? "ASCII text" : "UTF-8 Unicode text";
+}
+
+/**
+ * @brief  Classifies one file
+ * @param  Name of the file
+ * @param  Buffer of FILE_RESULT_LENGTH bytes receiving the description
+ * @return -1 on error, 0 on success
+ */
+int classify_file(const char* name, char* result) {
+  unsigned char head[FILE_HEAD_SIZE];
+  const char* description;
+  struct stat stats;
+  ssize_t length;
+  int fd;
+
+  if (lstat(name, &stats) == -1) {
+    snprintf(result, FILE_RESULT_LENGTH, "cannot open (%s)", strerror(errno));
+    return -1;
+  }
+  if (S_ISLNK(stats.st_mode)) {
+    char target[MAX_PATH_LENGTH];
+    ssize_t size = readlink(name, target, sizeof(target) - 1);
+    snprintf(result, FILE_RESULT_LENGTH, "symbolic link to %.*s",
+             (int) (size > 0 ? size : 0), target);
+    return 0;
+  }
+  if (!S_ISREG(stats.st_mode)) {
+    snprintf(result, FILE_RESULT_LENGTH, "%s",
+             S_ISDIR(stats.st_mode) ? "directory" : S_ISFIFO(stats.st_mode) ? "fifo (named pipe)"
+             : S_ISSOCK(stats.st_mode) ? "socket" : S_ISCHR(stats.st_mode) ? "character special"
+             : "block special");
+    return 0;
+  }
+  if (stats.st_size == 0) {
+    snprintf(result, FILE_RESULT_LENGTH, "empty");
+    return 0;
+  }
+
+  if ((fd = open(name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) == -1 ||
+      (length = pread(fd, head, sizeof(head), 0)) == -1) {
+    snprintf(result, FILE_RESULT_LENGTH, "cannot open (%s)", strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  close(fd);
+  throttle_io(length);
+
+  if ((description = match_signature(head, length)) == NULL)
+    description = classify_text(head, length);
+  snprintf(result, FILE_RESULT_LENGTH, "%s", description);
+  return 0;
+}
+
+/**
+ * @brief  Worker for file. Takes the next unclaimed name and classifies it
+ *         once the governor grants a slot.
+ * @param  The file_job
+ * @return Always NULL
+ */
+void* file_worker(void* arg) {
+  struct file_job* job = arg;
+  struct timespec start, end;
+  int i;
+
+  set_ioprio(active_throttle.ioprio);
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->files->count) {
+    throttle_io(0);
+    governor_acquire();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (classify_file(job->files->entries[i].name, job->results[i]) == -1)
+      atomic_fetch_add(&job->failures, 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    governor_release((end.tv_sec - start.tv_sec) * 1e6 +
+                     (end.tv_nsec - start.tv_nsec) / 1e3);
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Describes the type of each file from its first FILE_HEAD_SIZE
+ *         bytes. Files are read in parallel under the I/O governor and
+ *         matched against compiled signature tries, falling back to a text
+ *         check. Reads follow the I/O priority and rate given by the
+ *         options, or the shell-wide default.
+ * @param  Argument count
+ * @param  Arguments: [--inode-order] [--ioprio CLASS] [--rate RATE] name...
+ * @return -1 if any file could not be read, 0 on success
+ */
+int do_file(int argc, char** argv) {
+  struct batch files = {0};
+  struct file_job job = { .files = &files };
+  pthread_t workers[MAX_WORKERS];
+  struct throttle t;
+  int spawned = 0;
+  int ioprio;
+
+  inode_order = take_flag(&argc, argv, "--inode-order");
+  if (parse_throttle(&argc, argv, &t) == -1)
+    return -1;
+  if (argc < 2) {
+    fprintf(stderr, "file: Usage: file [--inode-order] [--ioprio CLASS] [--rate RATE] name...\n");
+    return -1;
+  }
+  pthread_once(&file_trie_once, build_file_trie);
+  for (int i = 1; i < argc; i++)
+    add_to_batch(&files, argv[i], 0);
+  order_batch(&files, true);
+  if ((job.results = calloc(files.count, sizeof(*job.results))) == NULL) {
+    fprintf(stderr, "file: Cannot allocate memory. %s.\n", strerror(errno));
+    free_batch(&files);
+    return -1;
+  }
+
+  ioprio = begin_throttle(&t);
+  while (spawned < MAX_WORKERS && spawned < files.count - 1 &&
+         pthread_create(&workers[spawned], NULL, file_worker, &job) == 0)
+    spawned++;
+  file_worker(&job);
+  while (spawned > 0)
+    pthread_join(workers[--spawned], NULL);
+  end_throttle(ioprio);
+
+  for (int i = 0; i < files.count; i++) {
+    out_write(files.entries[i].name, strlen(files.entries[i].name));
+    out_write(": ", 2);
+    out_write(job.results[i], strlen(job.results[i]));
+    out_char('\n');
+  }
+  free(job.results);
+  free_batch(&files);
+  return atomic_load(&job.failures) ? -1 : 0;
+}
+
+/**
+ * @brief  Creates one or more directories
+ * @param  Argument count
+ * @param  Arguments: [--durable] name...
+ * @return -1 if any directory could not be created, 0 on success
+ */
+int builtin_mkdir(int argc, char** argv) {
+  int result = 0;
+
+  invalidate_metadata();
+  durable = take_flag(&argc, argv, "--durable");
+  if (argc < 2) {
+    fprintf(stderr, "mkdir: Usage: mkdir [--durable] name...\n");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++)
+    if (do_mkdir(argv[i]) == -1)
+      result = -1;
+  if (durable_commit("mkdir") == -1)
+    result = -1;
+  return result;
+}
+
+/**
+ * @brief  Moves (renames) a file or directory. If the destination is an
+ *         existing directory, the source is moved into it.
+ * @param  Argument count
+ * @param  Arguments: [--durable] source destination
+ * @return -1 on error, 0 on success
+ */
+int do_mv(int argc, char** argv) {
+  char target[2 * MAX_PATH_LENGTH];
+  struct stat stats;
+  int result = 0;
+
+  invalidate_metadata();
+  durable = take_flag(&argc, argv, "--durable");
+  if (argc != 3) {
+    fprintf(stderr, "mv: Usage: mv [--durable] source destination\n");
+    durable_commit("mv");
+    return -1;
+  }
+
+  snprintf(target, sizeof(target), "%s", argv[2]);
+  if (stat(argv[2], &stats) == 0 && S_ISDIR(stats.st_mode)) {
+    const char* base = strrchr(argv[1], '/');
+    snprintf(target, sizeof(target), "%s/%s", argv[2], base ? base + 1 : argv[1]);
+  }
+  if (rename(argv[1], target) == -1) {
+    fprintf(stderr, "mv: Cannot move %s. %s.\n", argv[1], strerror(errno));
+    result = -1;
+  } else {
+    durable_add_parent(argv[1]);
+    durable_add_parent(target);
+  }
+  if (durable_commit("mv") == -1)
+    result = -1;
+  return result;
+}
+
+/**
+ * @brief  Updates the timestamps of files, creating any that do not exist
+ * @param  Argument count
+ * @param  Arguments: [--durable] name...
+ * @return -1 on error, 0 on success
+ */
+int do_touch(int argc, char** argv) {
+  int result = 0;
+
+  invalidate_metadata();
+  durable = take_flag(&argc, argv, "--durable");
+  if (argc < 2) {
+    fprintf(stderr, "touch: Usage: touch [--durable] name...\n");
+    durable_commit("touch");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++) {
+    int fd = open(argv[i], O_WRONLY | O_CREAT | O_NONBLOCK | O_NOCTTY | O_CLOEXEC, 0666);
+    if (fd == -1 || futimens(fd, NULL) == -1) {
+      fprintf(stderr, "touch: Cannot touch %s. %s.\n", argv[i], strerror(errno));
+      result = -1;
+    } else {
+      durable_add(argv[i]);
+      durable_add_parent(argv[i]);
+    }
+    if (fd != -1)
+      close(fd);
+  }
+  if (durable_commit("touch") == -1)
+    result = -1;
+  return result;
+}
+
+/**
+ * @brief  Reads until a buffer is full or input ends
+ * @param  Descriptor to read
+ * @param  Buffer
+ * @param  Size of the buffer
+ * @return Number of bytes read, or -1 on error
+ */
+ssize_t read_full(int fd, void* data, size_t size) {
+  size_t used = 0;
+
+  while (used < size) {
+    ssize_t length = read_input(fd, (char*) data + used, size - used);
+    if (length == -1 && errno == EINTR)
+      continue;
+    if (length == -1)
+      return -1;
+    if (length == 0)
+      break;
+    used += length;
+  }
+  return used;
+}
+
+/**
+ * @brief  Moves bytes from one pipe to a file or pipe with splice(2)
+ * @param  Descriptor to move from
+ * @param  Descriptor to move to
+ * @param  Number of bytes
+ * @return -1 on error, 0 on success
+ */
+int splice_all(int from, int to, size_t length) {
+  while (length > 0) {
+    ssize_t moved = splice(from, NULL, to, NULL, length, SPLICE_F_MOVE);
+    if (moved <= 0)
+      return -1;
+    length -= moved;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Copies the input stdio read along with the command line to
+ *         standard output and to files, so the rest of the input can be
+ *         moved straight from the descriptor
+ * @param  Descriptors of the files
+ * @param  Number of files
+ * @return -1 on error, 0 on success
+ */
+int tee_read_ahead(const int* files, int count) {
+  char data[BUFSIZ];
+
+  while (read_ahead() > 0) {
+    size_t length = fread(data, 1, read_ahead() < sizeof(data) ? read_ahead() : sizeof(data), stdin);
+    if (write_all(STDOUT_FILENO, data, length) == -1)
+      return -1;
+    for (int i = 0; i < count; i++)
+      if (write_all(files[i], data, length) == -1)
+        return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Copies standard input to standard output and to files through a
+ *         buffer, for input or output that is not a pipe
+ * @param  Descriptors of the files
+ * @param  Number of files
+ * @return -1 on error, 0 on success
+ */
+int tee_buffered(const int* files, int count) {
+  static char data[TEE_CHUNK];
+  ssize_t length;
+
+  while ((length = read_input(STDIN_FILENO, data, sizeof(data))) != 0) {
+    if (length == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (write_all(STDOUT_FILENO, data, length) == -1)
+      return -1;
+    for (int i = 0; i < count; i++)
+      if (write_all(files[i], data, length) == -1)
+        return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Copies standard input to standard output and to files without the
+ *         data passing through user space. tee(2) duplicates each chunk
+ *         into the output pipe and into a spare pipe per extra file, and the
+ *         last file consumes the input with splice(2). tee(2) always copies
+ *         from the start of the input, so if it duplicates less than the
+ *         whole chunk the rest of the chunk, and of the input, is copied
+ *         through a buffer instead.
+ * @param  Descriptors of the files
+ * @param  Number of files
+ * @return -1 on error, 0 on success
+ */
+int tee_zero_copy(const int* files, int count) {
+  static char data[TEE_CHUNK];
+  int spare[2];
+  ssize_t chunk;
+
+  // With no files there is nothing to duplicate, only to move
+  if (count == 0) {
+    while ((chunk = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, TEE_CHUNK,
+                           SPLICE_F_MOVE)) > 0)
+      ;
+    return chunk == 0 ? 0 : -1;
+  }
+
+  if (pipe2(spare, O_CLOEXEC) == -1)
+    return -1;
+  // Let a whole chunk fit in the spare pipe; the default may be smaller
+  fcntl(spare[1], F_SETPIPE_SZ, TEE_CHUNK);
+  while ((chunk = tee(STDIN_FILENO, STDOUT_FILENO, TEE_CHUNK, 0)) > 0) {
+    // Every file but the last gets a copy by way of the spare pipe
+    for (int i = 0; i < count - 1; i++) {
+      ssize_t copied = tee(STDIN_FILENO, spare[1], chunk, 0);
+
+      if (copied <= 0 || splice_all(spare[0], files[i], copied) == -1)
+        goto error;
+      if (copied < chunk) {
+        close(spare[0]);
+        close(spare[1]);
+        if (read_full(STDIN_FILENO, data, chunk) != chunk ||
+            write_all(files[i], data + copied, chunk - copied) == -1)
+          return -1;
+        while (++i < count)
+          if (write_all(files[i], data, chunk) == -1)
+            return -1;
+        return tee_buffered(files, count);
+      }
+    }
+    if (splice_all(STDIN_FILENO, files[count - 1], chunk) == -1)
+      goto error;
+  }
+  close(spare[0]);
+  close(spare[1]);
+  return chunk == 0 ? 0 : -1;
+
+ error:
+  close(spare[0]);
+  close(spare[1]);
+  return -1;
+}
+
+/**
+ * @brief  Copies standard input to standard output and to each named file
+ *         until end of input
+ * @param  Argument count
+ * @param  Arguments: [-a] file...
+ * @return -1 on error, 0 on success
+ */
+int do_tee(int argc, char** argv) {
+  int files[MAX_ARGS];
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  struct stat in, out;
+  int count = 0;
+  int result;
+
+  invalidate_metadata();
+  if (take_flag(&argc, argv, "-a"))
+    flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+  for (int i = 1; i < argc; i++) {
+    if ((files[count] = open(argv[i], flags, 0666)) == -1) {
+      fprintf(stderr, "tee: Cannot open %s. %s.\n", argv[i], strerror(errno));
+      while (count > 0)
+        close(files[--count]);
+      return -1;
+    }
+    count++;
+  }
+
+  fflush(stdout);
+  if (tee_read_ahead(files, count) == -1)
+    result = -1;
+  // splice(2) into files opened for appending is not supported everywhere
+  else if (fstat(STDIN_FILENO, &in) == 0 && S_ISFIFO(in.st_mode) &&
+      fstat(STDOUT_FILENO, &out) == 0 && S_ISFIFO(out.st_mode) &&
+      !(flags & O_APPEND))
+    result = tee_zero_copy(files, count);
+  else
+    result = tee_buffered(files, count);
+
+  if (result == -1)
+    fprintf(stderr, "tee: Cannot copy input. %s.\n", strerror(errno));
+  while (count > 0)
+    close(files[--count]);
+  return result;
+}
+
+static const char base64_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * @brief  Encodes bytes as base64 one group of three at a time, padding the
+ *         last group
+ * @param  Bytes to encode
+ * @param  Number of bytes
+ * @param  Buffer receiving the characters
+ * @return Number of characters written
+ */
+size_t base64_encode_scalar(const unsigned char* in, size_t length, char* out) {
+  char* start = out;
+  size_t i;
+
+  for (i = 0; i + 3 <= length; i += 3) {
+    unsigned int group = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+    *out++ = base64_alphabet[group >> 18];
+    *out++ = base64_alphabet[group >> 12 & 63];
+    *out++ = base64_alphabet[group >> 6 & 63];
+    *out++ = base64_alphabet[group & 63];
+  }
+  if (i < length) {
+    unsigned int group = in[i] << 16 | (i + 1 < length ? in[i + 1] << 8 : 0);
+    *out++ = base64_alphabet[group >> 18];
+    *out++ = base64_alphabet[group >> 12 & 63];
+    *out++ = i + 1 < length ? base64_alphabet[group >> 6 & 63] : '=';
+    *out++ = '=';
+  }
+  return out - start;
+}
+
+/**
+ * @brief  Decodes complete groups of four base64 characters. Padding may
+ *         only appear in the last group.
+ * @param  Characters to decode, a multiple of four
+ * @param  Number of characters
+ * @param  Buffer receiving the bytes
+ * @param  Set when the input ended with padding
+ * @return Number of bytes written, or -1 if the input is not base64
+ */
+ssize_t base64_decode_scalar(const char* in, size_t length, unsigned char* out, bool* padded) {
+  static signed char values[256];
+  unsigned char* start = out;
+
+  if (values[0] == 0) {
+    memset(values, -1, sizeof(values));
+    for (int i = 0; i < 64; i++)
+      values[(unsigned char) base64_alphabet[i]] = i;
+  }
+  for (size_t i = 0; i < length; i += 4) {
+    int a = values[(unsigned char) in[i]], b = values[(unsigned char) in[i + 1]];
+    int c = values[(unsigned char) in[i + 2]], d = values[(unsigned char) in[i + 3]];
+    bool last = i + 4 == length;
+
+    if (a < 0 || b < 0)
+      return -1;
+    *out++ = a << 2 | b >> 4;
+    if (c < 0 || d < 0) {
+      if (!last || in[i + 3] != '=' || (c < 0 && in[i + 2] != '='))
+        return -1;
+      if (c >= 0)
+        *out++ = (b << 4 | c >> 2) & 0xff;
+      *padded = true;
+      break;
+    }
+    *out++ = (b << 4 | c >> 2) & 0xff;
+    *out++ = (c << 6 | d) & 0xff;
+  }
+  return out - start;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief  Encodes base64 twelve bytes at a time with SSSE3: a byte shuffle
+ *         spreads each group of three bytes over four lanes, two multiplies
+ *         move the 6-bit fields into place, and a table lookup with pshufb
+ *         turns them into characters. The remainder is done by the scalar
+ *         encoder.
+ * @param  Bytes to encode
+ * @param  Number of bytes
+ * @param  Buffer receiving the characters
+ * @return Number of characters written
+ */
+__attribute__((target("ssse3")))
+size_t base64_encode_ssse3(const unsigned char* in, size_t length, char* out) {
+  const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t done = 0;
+  char* start = out;
+
+  // Each step loads 16 bytes but consumes 12
+  for (; done + 16 <= length; done += 12, out += 16) {
+    __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + done)), spread);
+    __m128i high = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)),
+                                   _mm_set1_epi32(0x04000040));
+    __m128i low = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)),
+                                  _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(high, low);
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                                              _mm_set1_epi8(13)));
+    _mm_storeu_si128((__m128i*) out,
+                     _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
+  }
+  return (out - start) + base64_encode_scalar(in + done, length - done, out);
+}
+
+/**
+ * @brief  Decodes base64 sixteen characters at a time with SSSE3. Character
+ *         classes are checked with two nibble lookups and translated to
+ *         6-bit values with a third; multiply-adds pack the values into
+ *         twelve bytes. A block with padding or anything invalid in it is
+ *         left to the scalar decoder, which reports the error.
+ * @param  Characters to decode, a multiple of four
+ * @param  Number of characters
+ * @param  Buffer receiving the bytes, with four bytes to spare
+ * @param  Set when the input ended with padding
+ * @return Number of bytes written, or -1 if the input is not base64
+ */
+__attribute__((target("ssse3")))
+ssize_t base64_decode_ssse3(const char* in, size_t length, unsigned char* out, bool* padded) {
+  const __m128i shifts = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i masks = _mm_setr_epi8(0xa8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8,
+                                      0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+  const __m128i bits = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+                                     0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  unsigned char* start = out;
+  size_t done = 0;
+  ssize_t rest;
+
+  // The last block goes to the scalar decoder since it may hold padding
+  for (; done + 16 < length; done += 16, out += 12) {
+    __m128i text = _mm_loadu_si128((const __m128i*) (in + done));
+    __m128i high = _mm_and_si128(_mm_srli_epi32(text, 4), _mm_set1_epi8(0x0f));
+    __m128i low = _mm_and_si128(text, _mm_set1_epi8(0x0f));
+    __m128i slash = _mm_cmpeq_epi8(text, _mm_set1_epi8('/'));
+    __m128i shift = _mm_or_si128(_mm_andnot_si128(slash, _mm_shuffle_epi8(shifts, high)),
+                                 _mm_and_si128(slash, _mm_set1_epi8(16)));
+    __m128i valid = _mm_and_si128(_mm_shuffle_epi8(masks, low), _mm_shuffle_epi8(bits, high));
+    __m128i values;
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())) != 0)
+      break;
+    values = _mm_add_epi8(text, shift);
+    values = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    values = _mm_madd_epi16(values, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i*) out, _mm_shuffle_epi8(values, pack));
+  }
+  if ((rest = base64_decode_scalar(in + done, length - done, out, padded)) == -1)
+    return -1;
+  return (out - start) + rest;
+}
+#endif
+
+static size_t (*base64_encode)(const unsigned char*, size_t, char*) = base64_encode_scalar;
+static ssize_t (*base64_decode)(const char*, size_t, unsigned char*, bool*) = base64_decode_scalar;
+
+/**
+ * @brief  Picks the fastest base64 routines this processor supports
+ */
+void select_base64(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    base64_encode = base64_encode_ssse3;
+    base64_decode = base64_decode_ssse3;
+  }
+#endif
+}
+
+/**
+ * @brief  Encodes input as base64 in lines of 76 characters
+ * @param  Input descriptor
+ * @param  Buffer of BASE64_CHUNK bytes for input
+ * @param  Buffer for the encoded chunk
+ * @return -1 on error, 0 on success
+ */
+int base64_encode_stream(int fd, unsigned char* data, char* text) {
+  ssize_t length;
+
+  while ((length = read_full(fd, data, BASE64_CHUNK)) > 0) {
+    char* end = text;
+
+    throttle_io(length);
+    for (ssize_t line = 0; line < length; line += BASE64_LINE) {
+      end += base64_encode(data + line, length - line < BASE64_LINE ? length - line : BASE64_LINE,
+                           end);
+      *end++ = '\n';
+    }
+    out_write(text, end - text);
+    if (length < BASE64_CHUNK)
+      break;
+  }
+  return length == -1 ? -1 : 0;
+}
+
+/**
+ * @brief  Decodes base64 input, skipping whitespace anywhere in it. Groups
+ *         split across reads are carried over to the next chunk.
+ * @param  Input descriptor
+ * @param  Buffer of BASE64_CHUNK bytes for input
+ * @param  Buffer for the characters kept and the decoded bytes
+ * @return -1 on error, 0 on success
+ */
+int base64_decode_stream(int fd, char* data, unsigned char* bytes) {
+  char* text = (char*) bytes + BASE64_CHUNK;
+  size_t kept = 0;
+  bool padded = false;
+  ssize_t length;
+
+  while ((length = read_full(fd, data, BASE64_CHUNK)) >= 0) {
+    size_t whole;
+    ssize_t decoded;
+
+    throttle_io(length);
+    for (ssize_t i = 0; i < length; i++)
+      if (!isspace((unsigned char) data[i]))
+        text[kept++] = data[i];
+    // Only complete groups are decoded until the input ends
+    whole = length < BASE64_CHUNK ? kept : kept & ~(size_t) 3;
+    if (whole % 4 != 0 || (padded && kept > 0)) {
+      errno = EINVAL;
+      return -1;
+    }
+    if ((decoded = base64_decode(text, whole, bytes, &padded)) == -1) {
+      errno = EINVAL;
+      return -1;
+    }
+    out_write((char*) bytes, decoded);
+    memmove(text, text + whole, kept - whole);
+    kept -= whole;
+    if (length < BASE64_CHUNK)
+      return 0;
+  }
+  return -1;
+}
+
+/**
+ * @brief  Encodes a file or standard input as base64, or decodes it with
+ *         -d. Processors with SSSE3 handle twelve bytes per instruction
+ *         sequence; others use a table-driven scalar loop.
+ * @param  Argument count
+ * @param  Arguments: [-d] [file]
+ * @return -1 on error, 0 on success
+ */
+int do_base64(int argc, char** argv) {
+  static pthread_once_t selected = PTHREAD_ONCE_INIT;
+  bool decode = take_flag(&argc, argv, "-d");
+  char* data;
+  char* text;
+  int fd = STDIN_FILENO;
+  int result;
+
+  if (argc > 2) {
+    fprintf(stderr, "base64: Usage: base64 [-d] [file]\n");
+    return -1;
+  }
+  if (argc == 2 && (fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "base64: Cannot open %s. %s.\n", argv[1], strerror(errno));
+    return -1;
+  }
+  pthread_once(&selected, select_base64);
+
+  // Encoding grows data by 4/3 plus newlines; decoding needs room for the
+  // kept characters after the decoded bytes
+  data = malloc(BASE64_CHUNK + 16);
+  text = malloc(2 * BASE64_CHUNK + 16);
+  if (data == NULL || text == NULL) {
+    errno = ENOMEM;
+    result = -1;
+  } else if (decode)
+    result = base64_decode_stream(fd, data, (unsigned char*) text);
+  else
+    result = base64_encode_stream(fd, (unsigned char*) data, text);
+
+  if (result == -1)
+    fprintf(stderr, "base64: Cannot %s input. %s.\n", decode ? "decode" : "encode",
+            errno == EINVAL ? "Invalid input" : strerror(errno));
+  free(data);
+  free(text);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return result;
+}
+
+/**
+ * @brief  Splits mapped data into up to max chunks of at least
+ *         MIN_CHUNK_SIZE bytes, moving each boundary forward to just after
+ *         a newline so no line is split
+ * @param  Data
+ * @param  Size of the data
+ * @param  Array receiving the chunks
+ * @param  Most chunks wanted
+ * @return Number of chunks
+ */
+int split_lines(const char* data, size_t size, struct line_chunk* chunks, int max) {
+  size_t target = size / max > MIN_CHUNK_SIZE ? size / max : MIN_CHUNK_SIZE;
+  const char* end = data + size;
+  const char* start = data;
+  int count = 0;
+
+  while (start < end) {
+    const char* stop = end - start > (ssize_t) target && count < max - 1
+                       ? memchr(start + target, '\n', end - start - target) : NULL;
+
+    stop = stop ? stop + 1 : end;
+    memset(&chunks[count], 0, sizeof(chunks[count]));
+    chunks[count].start = start;
+    chunks[count++].end = stop;
+    start = stop;
+  }
+  return count;
+}
+
+/**
+ * @brief  Runs a worker on every chunk at once, the last on this thread
+ * @param  Chunks
+ * @param  Number of chunks
+ * @param  Worker, given one chunk
+ */
+void run_chunks(struct line_chunk* chunks, int count, void* (*worker)(void*)) {
+  pthread_t threads[MAX_WORKERS];
+  int spawned = 0;
+
+  while (spawned < count - 1 &&
+         pthread_create(&threads[spawned], NULL, worker, &chunks[spawned]) == 0)
+    spawned++;
+  for (int i = spawned; i < count; i++)
+    worker(&chunks[i]);
+  while (spawned > 0)
+    pthread_join(threads[--spawned], NULL);
+}
+
+/**
+ * @brief  Adds bytes to the output of a chunk
+ * @param  Chunk
+ * @param  Data to add
+ * @param  Number of bytes
+ */
+void chunk_write(struct line_chunk* chunk, const char* data, size_t length) {
+  if (chunk->used + length > chunk->capacity) {
+    size_t capacity = chunk->capacity ? chunk->capacity : 64 * 1024;
+    char* grown;
+
+    while (capacity < chunk->used + length)
+      capacity *= 2;
+    if ((grown = realloc(chunk->out, capacity)) == NULL)
+      return;
+    chunk->out = grown;
+    chunk->capacity = capacity;
+  }
+  memcpy(chunk->out + chunk->used, data, length);
+  chunk->used += length;
+}
+
+/**
+ * @brief  Maps a whole file for reading
+ * @param  Name of the file
+ * @param  Receives the size
+ * @param  Command name for error messages
+ * @return The mapping, "" for an empty file, or NULL on error
+ */
+const char* map_file(const char* name, size_t* size, const char* command) {
+  struct stat stats;
+  const char* data;
+  int fd;
+
+  if ((fd = open(name, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &stats) == -1) {
+    fprintf(stderr, "%s: Cannot open %s. %s.\n", command, name, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  *size = stats.st_size;
+  data = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "%s: Cannot map %s. %s.\n", command, name, strerror(errno));
+    return NULL;
+  }
+  if (*size)
+    madvise((void*) data, *size, MADV_SEQUENTIAL);
+  return data;
+}
+
+/**
+ * @brief  Finds the quotes, backslashes and other structural characters in
+ *         64 bytes of JSON, one bit per byte
+ * @param  64 bytes
+ * @param  Receives the quote bits
+ * @param  Receives the backslash bits
+ * @param  Receives the bits for { } [ ] : and ,
+ */
+void classify_block(const char* block, uint64_t* quotes, uint64_t* backslashes,
+                    uint64_t* structurals) {
+#ifdef __SSE2__
+  *quotes = *backslashes = *structurals = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*) (block + 16 * i));
+    // Braces differ from brackets only in bit 5, so clearing it lets one
+    // comparison find both
+    __m128i folded = _mm_and_si128(bytes, _mm_set1_epi8(~0x20));
+    __m128i open = _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('[')),
+                                _mm_cmpeq_epi8(folded, _mm_set1_epi8(']')));
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(':')),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8(',')));
+
+    *quotes |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'))) << (16 * i);
+    *backslashes |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                      _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\'))) << (16 * i);
+    *structurals |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(open, other)) << (16 * i);
+  }
+#else
+  *quotes = *backslashes = *structurals = 0;
+  for (int i = 0; i < 64; i++) {
+    char c = block[i];
+    *quotes |= (uint64_t) (c == '"') << i;
+    *backslashes |= (uint64_t) (c == '\\') << i;
+    *structurals |= (uint64_t) (c == '{' || c == '}' || c == '[' || c == ']' ||
+                                c == ':' || c == ',') << i;
+  }
+#endif
+}
+
+/**
+ * @brief  Indexes the structural characters of a JSON record, 64 bytes at
+ *         a time as in simdjson's first stage: quotes preceded by an odd
+ *         run of backslashes are dropped, a prefix XOR of the remaining
+ *         quotes marks the inside of strings, and anything structural
+ *         inside a string is dropped. No values are parsed.
+ * @param  Record
+ * @param  Length of the record
+ * @param  Index to fill in
+ * @return -1 if out of memory, 0 on success
+ */
+int index_json(const char* text, size_t length, struct json_index* index) {
+  const uint64_t even = 0x5555555555555555ULL;
+  uint64_t escape_carry = 0, string_carry = 0;
+  char tail[64];
+
+  index->count = 0;
+  for (size_t base = 0; base < length; base += 64) {
+    const char* block = text + base;
+    uint64_t quotes, backslashes, structurals, escaped, inside, found;
+    uint64_t starts, follows, runs;
+
+    if (length - base < 64) {
+      // Never read past the record, which may end the mapping
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, block, length - base);
+      block = tail;
+    }
+    classify_block(block, &quotes, &backslashes, &structurals);
+
+    // Characters escaped by a backslash, following odd-length runs only
+    backslashes &= ~escape_carry;
+    follows = backslashes << 1 | escape_carry;
+    starts = backslashes & ~even & ~follows;
+    escape_carry = __builtin_add_overflow(starts, backslashes, &runs);
+    escaped = (even ^ (runs << 1)) & follows;
+    quotes &= ~escaped;
+
+    inside = quotes;
+    for (int shift = 1; shift < 64; shift <<= 1)
+      inside ^= inside << shift;
+    inside ^= string_carry;
+    string_carry = (uint64_t) ((int64_t) inside >> 63);
+
+    found = (structurals & ~inside) | quotes;
+    while (found != 0) {
+      if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 256;
+        uint32_t* grown = realloc(index->positions, capacity * sizeof(uint32_t));
+        if (grown == NULL)
+          return -1;
+        index->positions = grown;
+        index->capacity = capacity;
+      }
+      index->positions[index->count++] = base + __builtin_ctzll(found);
+      found &= found - 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief  Finds the structural index just past a value that starts at a
+ *         structural character
+ * @param  Record
+ * @param  Index of the record
+ * @param  Index of the first character of the value
+ * @return Index past the value
+ */
+size_t skip_json(const char* text, const struct json_index* index, size_t i) {
+  int depth = 0;
+
+  if (text[index->positions[i]] == '"')
+    return i + 2;
+  for (; i < index->count; i++) {
+    char c = text[index->positions[i]];
+    if (c == '{' || c == '[')
+      depth++;
+    else if ((c == '}' || c == ']') && --depth == 0)
+      return i + 1;
+  }
+  return i;
+}
+
+/**
+ * @brief  Finds the value at a path in an indexed record, visiting only
+ *         structural positions and skipping whole subtrees that are not on
+ *         the path
+ * @param  Record
+ * @param  Index of the record
+ * @param  Path to follow
+ * @param  Receives the start of the value; strings exclude their quotes
+ * @param  Receives the length of the value
+ * @return Whether the path exists
+ */
+bool find_json(const char* text, const struct json_index* index, const struct json_path* path,
+               const char** value, size_t* length) {
+  size_t i = 0;
+
+  if (index->count == 0)
+    return false;
+  for (int level = 0; level < path->depth; level++) {
+    const char* key = path->keys[level];
+    int key_length = path->lengths[level];
+    char open = text[index->positions[i]];
+    long element = 0, wanted = -1;
+    bool matched = false;
+
+    if (open == '[') {
+      char* end;
+      wanted = strtol(key, &end, 10);
+      if (end != key + key_length)
+        return false;
+    } else if (open != '{')
+      return false;
+
+    for (i++; i < index->count && !matched; element++) {
+      char c = text[index->positions[i]];
+      const char* start;
+
+      if (c == '}' || c == ']')
+        return false;
+      if (open == '{') {
+        // A key is a quoted string followed by a colon
+        if (c != '"' || i + 2 >= index->count)
+          return false;
+        matched = index->positions[i + 1] - index->positions[i] - 1 == (uint32_t) key_length &&
+                  !memcmp(text + index->positions[i] + 1, key, key_length);
+        i += 2;
+        start = text + index->positions[i] + 1;
+        i++;
+      } else {
+        matched = element == wanted;
+        start = text + index->positions[i - 1] + 1;
+      }
+
+      while (*start == ' ' || *start == '\t')
+        start++;
+      if (i < index->count && start == text + index->positions[i] && *start != ',' &&
+          *start != '}' && *start != ']') {
+        // An object, array or string
+        if (matched && level == path->depth - 1) {
+          size_t after = skip_json(text, index, i);
+          bool string = *start == '"';
+          *value = start + string;
+          *length = text + index->positions[after - 1] + 1 - start - 2 * string;
+          return true;
+        }
+        if (!matched)
+          i = skip_json(text, index, i);
+      } else {
+        // A number, true, false or null, ending at the next structural
+        const char* end = i < index->count ? text + index->positions[i] : start;
+        if (matched) {
+          if (level < path->depth - 1)
+            return false;
+          while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+            end--;
+          *value = start;
+          *length = end - start;
+          return true;
+        }
+      }
+      if (!matched) {
+        if (i >= index->count || text[index->positions[i]] != ',')
+          return false;
+        i++;
+      }
+    }
+    if (!matched)
+      return false;
+  }
+  return false;
+}
+
+/**
+ * @brief  Splits a dotted path such as ".request.status" into keys. The
+ *         keys point into the text, which must outlive the path.
+ * @param  Text of the path
+ * @param  Length of the path
+ * @param  Path to fill in
+ * @return -1 if the path is empty or too deep, 0 on success
+ */
+int parse_json_path(const char* text, size_t length, struct json_path* path) {
+  const char* end = text + length;
+
+  path->depth = 0;
+  if (text < end && *text == '.')
+    text++;
+  while (text < end) {
+    const char* dot = memchr(text, '.', end - text);
+    size_t key = (dot ? dot : end) - text;
+
+    if (key == 0 || path->depth == JL_MAX_DEPTH)
+      return -1;
+    path->keys[path->depth] = text;
+    path->lengths[path->depth++] = key;
+    text += key + (dot != NULL);
+  }
+  return path->depth > 0 ? 0 : -1;
+}
+
+/**
+ * @brief  Checks a record against one --where condition
+ * @param  Condition
+ * @param  Value found, or NULL if the field is missing
+ * @param  Length of the value
+ * @return Whether the record passes
+ */
+bool jl_passes(const struct jl_filter* filter, const char* value, size_t length) {
+  char number[64];
+  double x;
+  char* end;
+
+  if (value == NULL)
+    return false;
+  if (!strcmp(filter->op, "="))
+    return strlen(filter->value) == length && !memcmp(filter->value, value, length);
+  if (!strcmp(filter->op, "!="))
+    return strlen(filter->value) != length || memcmp(filter->value, value, length);
+
+  snprintf(number, sizeof(number), "%.*s", (int) length, value);
+  x = strtod(number, &end);
+  if (end == number || *end != 0)
+    return false;
+  switch (filter->op[0] << 8 | filter->op[1]) {
+  case '>' << 8:        return x > filter->number;
+  case '<' << 8:        return x < filter->number;
+  case '>' << 8 | '=':  return x >= filter->number;
+  case '<' << 8 | '=':  return x <= filter->number;
+  }
+  return false;
+}
+
+/**
+ * @brief  Worker for jl: indexes each record of a chunk, applies the
+ *         filters and collects the selected fields or the whole record
+ * @param  The line_chunk
+ * @return Always NULL
+ */
+void* jl_worker(void* arg) {
+  struct line_chunk* chunk = arg;
+  const struct jl_job* job = chunk->job;
+  struct json_index index = {0};
+
+  for (const char* line = chunk->start; line < chunk->end; ) {
+    const char* newline = memchr(line, '\n', chunk->end - line);
+    const char* end = newline ? newline : chunk->end;
+    bool keep = true;
+
+    if (end > line && index_json(line, end - line, &index) == 0) {
+      for (int i = 0; i < job->filter_count && keep; i++) {
+        const char* value = NULL;
+        size_t length = 0;
+        if (!find_json(line, &index, &job->filters[i].path, &value, &length))
+          value = NULL;
+        keep = jl_passes(&job->filters[i], value, length);
+      }
+      if (keep && job->field_count == 0) {
+        chunk_write(chunk, line, end - line);
+        chunk_write(chunk, "\n", 1);
+      } else if (keep) {
+        for (int i = 0; i < job->field_count; i++) {
+          const char* value;
+          size_t length;
+          if (i > 0)
+            chunk_write(chunk, "\t", 1);
+          if (find_json(line, &index, &job->fields[i], &value, &length))
+            chunk_write(chunk, value, length);
+        }
+        chunk_write(chunk, "\n", 1);
+      }
+    }
+    line = end + 1;
+  }
+  free(index.positions);
+  return NULL;
+}
+
+/**
+ * @brief  Filters JSON-lines records and extracts fields. The file is
+ *         mapped and split at line boundaries into one chunk per processor;
+ *         each record is indexed with a vectorized scan of its structural
+ *         characters and fields are found by walking that index, without
+ *         building a tree or converting values.
+ *           jl [--where PATH OP VALUE]... file [PATH...]
+ *         OP is one of = != < <= > >=; the last four compare numbers. With
+ *         no PATHs whole matching records are output, otherwise the values
+ *         of the PATHs separated by tabs, strings without their quotes but
+ *         with escapes as written.
+ * @param  Argument count
+ * @param  Arguments
+ * @return -1 on error, 0 on success
+ */
+int do_jl(int argc, char** argv) {
+  struct line_chunk chunks[MAX_WORKERS];
+  struct jl_job job = {0};
+  const char* name = NULL;
+  const char* data;
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t size;
+  int count;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--where") && i + 1 < argc && job.filter_count < JL_MAX_FILTERS) {
+      struct jl_filter* filter = &job.filters[job.filter_count++];
+      const char* condition = argv[++i];
+      size_t key = strcspn(condition, "=!<>");
+      size_t op = strspn(condition + key, "=!<>");
+      bool numeric;
+      char* end;
+
+      // The operator is the whole run of comparison characters, so s==200
+      // and s<>200 are rejected rather than read as something else
+      snprintf(filter->op, sizeof(filter->op), "%.*s", op < 3 ? (int) op : 0, condition + key);
+      filter->value = condition + key + op;
+      numeric = !strcmp(filter->op, "<") || !strcmp(filter->op, "<=") ||
+                !strcmp(filter->op, ">") || !strcmp(filter->op, ">=");
+      filter->number = strtod(filter->value, &end);
+      if ((!numeric && strcmp(filter->op, "=") != 0 && strcmp(filter->op, "!=") != 0) ||
+          (numeric && (end == filter->value || *end != 0)) ||
+          parse_json_path(condition, key, &filter->path) == -1) {
+        fprintf(stderr, "jl: Usage: jl [--where PATH OP VALUE]... file [PATH...]\n");
+        return -1;
+      }
+    } else if (name == NULL && strncmp(argv[i], "--", 2) != 0)
+      name = argv[i];
+    else if (name != NULL && job.field_count < JL_MAX_FIELDS &&
+             parse_json_path(argv[i], strlen(argv[i]), &job.fields[job.field_count]) == 0)
+      job.field_count++;
+    else {
+      fprintf(stderr, "jl: Usage: jl [--where PATH OP VALUE]... file [PATH...]\n");
+      return -1;
+    }
+  }
+  if (name == NULL) {
+    fprintf(stderr, "jl: Usage: jl [--where PATH OP VALUE]... file [PATH...]\n");
+    return -1;
+  }
+  if ((data = map_file(name, &size, "jl")) == NULL)
+    return -1;
+
+  count = split_lines(data, size, chunks,
+                      processors < 1 ? 1 : processors > MAX_WORKERS ? MAX_WORKERS : processors);
+  for (int i = 0; i < count; i++)
+    chunks[i].job = &job;
+  run_chunks(chunks, count, jl_worker);
+  for (int i = 0; i < count; i++) {
+    out_write(chunks[i].out, chunks[i].used);
+    free(chunks[i].out);
+  }
+  if (size)
+    munmap((void*) data, size);
+  return 0;
+}
+
+/**
+ * @brief  Parses a decimal number occupying exactly the given text. Up to
+ *         15 significant digits with a small exponent are converted exactly
+ *         with one multiply or divide; anything else goes to strtod.
+ * @param  Start of the text
+ * @param  End of the text
+ * @param  Receives the value
+ * @return Whether the text is a number
+ */
+bool parse_number(const char* text, const char* end, double* value) {
+  static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                   1e20, 1e21, 1e22 };
+  const char* p = text;
+  unsigned long long digits = 0;
+  int significant = 0, exponent = 0;
+  bool negative = false, any = false;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  for (; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+    if (significant < 19) {
+      digits = digits * 10 + (*p - '0');
+      significant += digits != 0;
+    } else
+      exponent++;
+  if (p < end && *p == '.')
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+      if (significant < 19) {
+        digits = digits * 10 + (*p - '0');
+        significant += digits != 0;
+        exponent--;
+      }
+  if (!any)
+    return false;
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    bool minus = false;
+    int power = 0;
+
+    if (++p < end && (*p == '-' || *p == '+'))
+      minus = *p++ == '-';
+    if (p == end || *p < '0' || *p > '9')
+      return false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+      power = power < 10000 ? power * 10 + (*p - '0') : power;
+    exponent += minus ? -power : power;
+  }
+  if (p != end)
+    return false;
+
+  if (significant <= 15 && exponent >= -22 && exponent <= 22) {
+    *value = exponent < 0 ? digits / powers[-exponent] : digits * powers[exponent];
+  } else {
+    char copy[64];
+    if (end - text >= (ssize_t) sizeof(copy))
+      return false;
+    snprintf(copy, sizeof(copy), "%.*s", (int) (end - text), text);
+    *value = strtod(copy, NULL);
+    return true;
+  }
+  if (negative)
+    *value = -*value;
+  return true;
+}
+
+/**
+ * @brief  Finds the histogram bucket of a nonzero magnitude straight from
+ *         the bits of the double: the exponent picks the power of two and
+ *         the top mantissa bits the bucket within it
+ * @param  Magnitude
+ * @return Bucket index
+ */
+int agg_bucket(double magnitude) {
+  uint64_t bits;
+  int exponent;
+
+  memcpy(&bits, &magnitude, sizeof(bits));
+  exponent = (int) (bits >> 52 & 0x7ff) - 1023;
+  if (exponent < AGG_MIN_EXPONENT)
+    return 0;
+  if (exponent >= AGG_MIN_EXPONENT + AGG_EXPONENTS)
+    return AGG_BUCKETS - 1;
+  return (exponent - AGG_MIN_EXPONENT) << AGG_SUB_BITS |
+         (int) (bits >> (52 - AGG_SUB_BITS) & (AGG_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief  Gives the value in the middle of a histogram bucket
+ * @param  Bucket index
+ * @return Magnitude
+ */
+double agg_bucket_value(int bucket) {
+  uint64_t bits = (uint64_t) ((bucket >> AGG_SUB_BITS) + AGG_MIN_EXPONENT + 1023) << 52;
+  double power;
+
+  memcpy(&power, &bits, sizeof(power));
+  return power * (1 + ((bucket & (AGG_SUB_BUCKETS - 1)) + 0.5) / AGG_SUB_BUCKETS);
+}
+
+/**
+ * @brief  Worker for agg: finds the column on each line of a chunk with
+ *         memchr and adds its value to the chunk's totals
+ * @param  The line_chunk
+ * @return Always NULL
+ */
+void* agg_worker(void* arg) {
+  struct line_chunk* chunk = arg;
+  const struct agg_job* job = chunk->job;
+  struct agg_stats* stats = chunk->state;
+
+  for (const char* line = chunk->start; line < chunk->end; ) {
+    const char* newline = memchr(line, '\n', chunk->end - line);
+    const char* end = newline ? newline : chunk->end;
+    const char* field = line;
+    const char* stop;
+    double value;
+    int column = 1;
+
+    if (end > line && end[-1] == '\r')
+      end--;
+    if (job->delimiter != 0) {
+      while (column < job->field && field != NULL) {
+        field = memchr(field, job->delimiter, end - field);
+        field = field ? field + 1 : NULL;
+        column++;
+      }
+      stop = field ? memchr(field, job->delimiter, end - field) : NULL;
+      stop = stop ? stop : end;
+    } else {
+      // Columns are separated by runs of blanks, as in awk
+      for (;; column++) {
+        while (field < end && (*field == ' ' || *field == '\t'))
+          field++;
+        for (stop = field; stop < end && *stop != ' ' && *stop != '\t'; stop++)
+          ;
+        if (column == job->field || field == end)
+          break;
+        field = stop;
+      }
+    }
+
+    if (field != NULL && field < stop && parse_number(field, stop, &value) && value == value) {
+      if (stats->count++ == 0)
+        stats->min = stats->max = value;
+      stats->sum += value;
+      stats->min = value < stats->min ? value : stats->min;
+      stats->max = value > stats->max ? value : stats->max;
+      if (value > 0)
+        stats->positive[agg_bucket(value)]++;
+      else if (value < 0)
+        stats->negative[agg_bucket(-value)]++;
+      else
+        stats->zeros++;
+      if (!stats->inexact && stats->count > stats->capacity) {
+        double* grown = NULL;
+        if (stats->capacity < job->exact_limit)
+          stats->capacity = stats->capacity ? stats->capacity * 2 : 1024;
+        if (stats->capacity > job->exact_limit)
+          stats->capacity = job->exact_limit;
+        if (stats->count <= stats->capacity)
+          grown = realloc(stats->values, stats->capacity * sizeof(double));
+        if (grown == NULL) {
+          free(stats->values);
+          stats->values = NULL;
+          stats->inexact = true;
+        } else
+          stats->values = grown;
+      }
+      if (!stats->inexact)
+        stats->values[stats->count - 1] = value;
+    } else if (newline != line)
+      stats->skipped++;
+    line = newline ? newline + 1 : chunk->end;
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Adds the totals of one chunk into another
+ * @param  Totals to add to
+ * @param  Totals to add
+ */
+void merge_agg(struct agg_stats* into, const struct agg_stats* from) {
+  // Values stay exact only while both sides kept all of theirs and fit
+  if (!into->inexact && (from->inexact || into->count + from->count > AGG_EXACT_LIMIT)) {
+    free(into->values);
+    into->values = NULL;
+    into->inexact = true;
+  } else if (!into->inexact && from->count > 0) {
+    double* grown = realloc(into->values, (into->count + from->count) * sizeof(double));
+    if (grown == NULL) {
+      free(into->values);
+      into->values = NULL;
+      into->inexact = true;
+    } else {
+      memcpy(grown + into->count, from->values, from->count * sizeof(double));
+      into->values = grown;
+    }
+  }
+  if (from->count > 0 && (into->count == 0 || from->min < into->min))
+    into->min = from->min;
+  if (from->count > 0 && (into->count == 0 || from->max > into->max))
+    into->max = from->max;
+  into->count += from->count;
+  into->skipped += from->skipped;
+  into->zeros += from->zeros;
+  into->sum += from->sum;
+  for (int i = 0; i < AGG_BUCKETS; i++) {
+    into->positive[i] += from->positive[i];
+    into->negative[i] += from->negative[i];
+  }
+}
+
+/**
+ * @brief  qsort comparison ordering doubles ascending
+ */
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief  Finds a percentile. While every value was kept, the values are
+ *         sorted and it is interpolated between the two nearest ranks;
+ *         otherwise it is estimated from the merged histogram.
+ * @param  Totals, with their values sorted if they were kept
+ * @param  Percentile, 0 to 100
+ * @return Value, kept between the minimum and maximum
+ */
+double agg_percentile(const struct agg_stats* stats, double percentile) {
+  unsigned long long rank = (unsigned long long) (percentile / 100 * (stats->count - 1));
+  unsigned long long seen = 0;
+  double value = stats->max;
+
+  if (!stats->inexact) {
+    double position = percentile / 100 * (stats->count - 1);
+    if (rank + 1 >= stats->count)
+      return stats->values[stats->count - 1];
+    return stats->values[rank] + (stats->values[rank + 1] - stats->values[rank]) * (position - rank);
+  }
+
+  // The extremes are known exactly
+  if (rank == 0)
+    return stats->min;
+  if (rank >= stats->count - 1)
+    return stats->max;
+  // From the most negative values up through zero to the largest
+  for (int i = AGG_BUCKETS - 1; i >= 0 && seen <= rank; i--)
+    if ((seen += stats->negative[i]) > rank)
+      value = -agg_bucket_value(i);
+  if (seen <= rank && (seen += stats->zeros) > rank)
+    value = 0;
+  for (int i = 0; i < AGG_BUCKETS && seen <= rank; i++)
+    if ((seen += stats->positive[i]) > rank)
+      value = agg_bucket_value(i);
+  return value < stats->min ? stats->min : value > stats->max ? stats->max : value;
+}
+
+/**
+ * @brief  Summarizes a numeric column of one or more files: count, sum,
+ *         minimum, maximum, mean and percentiles. Each file is mapped and
+ *         split into one chunk per processor; every chunk keeps its own
+ *         totals and log-bucketed histogram, which are merged at the end.
+ *         Percentiles are exact for up to AGG_EXACT_LIMIT values, which are
+ *         kept as well; beyond that they come from the histogram, within
+ *         0.8% of the true value.
+ *         Lines whose column is not a number, such as headers, are counted
+ *         and skipped.
+ * @param  Argument count
+ * @param  Arguments: [-f column] [-d delimiter] [-p percentile,...] file...
+ * @return -1 on error, 0 on success
+ */
+int do_agg(int argc, char** argv) {
+  struct line_chunk chunks[MAX_WORKERS];
+  struct agg_job job = { .field = 1 };
+  struct agg_stats* total = calloc(1, sizeof(*total));
+  double percentiles[AGG_MAX_PERCENTILES] = { 50, 90, 99 };
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  int percentile_count = 3, first, result = 0;
+
+  for (first = 1; first + 1 < argc && argv[first][0] == '-' && argv[first][1] != 0 &&
+                  argv[first][2] == 0; first += 2) {
+    const char* value = argv[first + 1];
+
+    if (argv[first][1] == 'f' && (job.field = atoi(value)) > 0)
+      continue;
+    if (argv[first][1] == 'd' && value[0] != 0 && value[1] == 0) {
+      job.delimiter = value[0];
+      continue;
+    }
+    if (argv[first][1] == 'p') {
+      const char* p = value;
+
+      // Every item of the list must be a percentile, or none is used
+      for (percentile_count = 0; *p != 0 && percentile_count < AGG_MAX_PERCENTILES; ) {
+        char* end;
+        double percentile = strtod(p, &end);
+        if (end == p || percentile < 0 || percentile > 100 || (*end != ',' && *end != 0))
+          break;
+        percentiles[percentile_count++] = percentile;
+        p = *end == ',' ? end + 1 : end;
+      }
+      if (percentile_count > 0 && *p == 0)
+        continue;
+    }
+    first = argc;
+  }
+  if (first >= argc || total == NULL) {
+    fprintf(stderr, "agg: Usage: agg [-f column] [-d delimiter] [-p percentile,...] file...\n");
+    free(total);
+    return -1;
+  }
+
+  for (int i = first; i < argc; i++) {
+    const char* data;
+    size_t size;
+    int count;
+
+    if ((data = map_file(argv[i], &size, "agg")) == NULL) {
+      result = -1;
+      continue;
+    }
+    count = split_lines(data, size, chunks,
+                        processors < 1 ? 1 : processors > MAX_WORKERS ? MAX_WORKERS : processors);
+    for (int j = 0; j < count; j++) {
+      chunks[j].job = &job;
+      if ((chunks[j].state = calloc(1, sizeof(struct agg_stats))) == NULL)
+        count = j;
+    }
+    // Chunks share the budget for exact values between them
+    job.exact_limit = count > 0 ? AGG_EXACT_LIMIT / count : 0;
+    run_chunks(chunks, count, agg_worker);
+    for (int j = 0; j < count; j++) {
+      merge_agg(total, chunks[j].state);
+      free(((struct agg_stats*) chunks[j].state)->values);
+      free(chunks[j].state);
+    }
+    if (size)
+      munmap((void*) data, size);
+  }
+
+  printf("count\t%llu\n", total->count);
+  if (total->count > 0) {
+    printf("sum\t%.10g\nmin\t%.10g\nmax\t%.10g\nmean\t%.10g\n", total->sum, total->min,
+           total->max, total->sum / total->count);
+    if (!total->inexact)
+      qsort(total->values, total->count, sizeof(double), compare_doubles);
+    for (int i = 0; i < percentile_count; i++)
+      printf("p%g\t%.6g\n", percentiles[i], agg_percentile(total, percentiles[i]));
+  }
+  fflush(stdout);
+  if (total->skipped > 0)
+    fprintf(stderr, "agg: Skipped %llu lines without a number in column %d\n",
+            total->skipped, job.field);
+  free(total->values);
+  free(total);
+  return result;
+}
+
+/**
+ * @brief  Parses a size such as "4096", "64K", "1M" or "2G"
+ * @param  Text to parse
+ * @param  Receives the size in bytes
+ * @return -1 on error, 0 on success
+ */
+int parse_size(const char* text, long long* size) {
+  char* unit;
+  long long value = strtoll(text, &unit, 10);
+
+  if (unit == text || value < 0)
+    return -1;
+  switch (*unit) {
+  case 0:   *size = value; return 0;
+  case 'K': value <<= 10; break;
+  case 'M': value <<= 20; break;
+  case 'G': value <<= 30; break;
+  default:  return -1;
+  }
+  if (unit[1] != 0)
+    return -1;
+  *size = value;
+  return 0;
+}
+
+/**
+ * @brief  Writes one block at an offset. A final short block cannot be
+ *         written with O_DIRECT, so it goes through the buffered output.
+ * @param  The dd_job
+ * @param  Data to write
+ * @param  Number of bytes
+ * @param  Offset to write at
+ * @return -1 on error, 0 on success
+ */
+int dd_write(const struct dd_job* job, const char* data, size_t length, off_t offset) {
+  int fd = length % DD_SECTOR != 0 && job->out_buffered != -1 ? job->out_buffered : job->out;
+
+  while (length > 0) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written == -1)
+      return -1;
+    data += written;
+    length -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+/**
+ * @brief  dd worker. Claims blocks one at a time and copies each with
+ *         pread/pwrite at its own offsets, so the workers keep several
+ *         requests in flight at once.
+ * @param  The dd_job
+ * @return Always NULL
+ */
+void* dd_worker(void* arg) {
+  struct dd_job* job = arg;
+  long long block;
+  char* data;
+
+  set_ioprio(active_throttle.ioprio);
+  if (posix_memalign((void**) &data, DD_ALIGNMENT, job->bs) != 0) {
+    atomic_store(&job->failed, errno = ENOMEM);
+    return NULL;
+  }
+  while (!atomic_load(&job->failed) &&
+         (block = atomic_fetch_add(&job->next, 1)) < job->blocks) {
+    ssize_t length;
+
+    throttle_io(job->bs);
+    length = pread(job->in, data, job->bs, (job->skip + block) * job->bs);
+    if (length == -1 ||
+        dd_write(job, data, length, (job->seek + block) * job->bs) == -1) {
+      atomic_store(&job->failed, errno);
+      break;
+    }
+    atomic_fetch_add(&job->copied, length);
+  }
+  free(data);
+  return NULL;
+}
+
+/**
+ * @brief  dd transfer for input that cannot be read at an offset, such as a
+ *         pipe. Blocks are copied in order until count or end of input.
+ * @param  The dd_job
+ */
+void dd_sequential(struct dd_job* job) {
+  char* data;
+  long long block;
+
+  if (posix_memalign((void**) &data, DD_ALIGNMENT, job->bs) != 0) {
+    atomic_store(&job->failed, ENOMEM);
+    return;
+  }
+  for (block = 0; job->blocks < 0 || block < job->blocks; block++) {
+    ssize_t length = 0, n = 0;
+
+    // Gather a full block where the input delivers it in pieces
+    while (length < job->bs &&
+           (n = read_input(job->in, data + length, job->bs - length)) > 0)
+      length += n;
+    if (n == -1 && length == 0) {
+      atomic_store(&job->failed, errno);
+      break;
+    }
+    if (length == 0)
+      break;
+    throttle_io(length);
+    if (length % DD_SECTOR != 0 && job->out_buffered != -1) {
+      off_t offset = lseek(job->out, 0, SEEK_CUR);
+      if (offset == -1 || dd_write(job, data, length, offset) == -1) {
+        atomic_store(&job->failed, errno);
+        break;
+      }
+    } else if (write_all(job->out, data, length) == -1) {
+      atomic_store(&job->failed, errno);
+      break;
+    }
+    atomic_fetch_add(&job->copied, length);
+  }
+  free(data);
+}
+
+/**
+ * @brief  Copies blocks between files or devices. Workers copy blocks at
+ *         their own offsets when both ends are regular files or block
+ *         devices named by if= and of=; anything else, including standard
+ *         output, is copied in order.
+ * @param  Argument count
+ * @param  Arguments: [if=FILE] [of=FILE] [bs=SIZE] [skip=N] [seek=N]
+ *         [count=N] [iflag=direct] [oflag=direct] [workers=N]
+ *         [--ioprio CLASS] [--rate RATE]
+ * @return -1 on error, 0 on success
+ */
+int do_dd(int argc, char** argv) {
+  struct dd_job job = { .in = STDIN_FILENO, .out = STDOUT_FILENO, .out_buffered = -1,
+                        .bs = DD_DEFAULT_BS, .blocks = -1 };
+  const char* input = NULL;
+  const char* output = NULL;
+  int in_flags = O_RDONLY | O_CLOEXEC;
+  int out_flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  long long workers = 1;
+  struct timespec start, end;
+  pthread_t threads[MAX_WORKERS];
+  struct throttle t;
+  struct stat stats;
+  bool offsets = false, seekable = false;
+  int spawned = 0;
+  int ioprio;
+  double seconds;
+
+  invalidate_metadata();
+  if (parse_throttle(&argc, argv, &t) == -1)
+    return -1;
+  for (int i = 1; i < argc; i++) {
+    const char* value = strchr(argv[i], '=');
+    int bad = value == NULL;
+    char key[16];
+
+    if (!bad) {
+      // Arguments may belong to a stored function body, so are not modified
+      snprintf(key, sizeof(key), "%.*s", (int) (value++ - argv[i]), argv[i]);
+      if (!strcmp(key, "if"))
+        input = value;
+      else if (!strcmp(key, "of"))
+        output = value;
+      else if (!strcmp(key, "bs"))
+        bad = parse_size(value, &job.bs) == -1 || job.bs == 0;
+      else if (!strcmp(key, "skip"))
+        bad = parse_size(value, &job.skip) == -1;
+      else if (!strcmp(key, "seek"))
+        bad = parse_size(value, &job.seek) == -1;
+      else if (!strcmp(key, "count"))
+        bad = parse_size(value, &job.blocks) == -1;
+      else if (!strcmp(key, "workers"))
+        bad = parse_size(value, &workers) == -1 || workers < 1 || workers > MAX_WORKERS;
+      else if (!strcmp(key, "iflag") && !strcmp(value, "direct"))
+        in_flags |= O_DIRECT;
+      else if (!strcmp(key, "oflag") && !strcmp(value, "direct"))
+        out_flags |= O_DIRECT;
+      else
+        bad = 1;
+    }
+    if (bad) {
+      fprintf(stderr, "dd: Invalid operand \"%s\"\n", argv[i]);
+      return -1;
+    }
+  }
+
+  if (((in_flags | out_flags) & O_DIRECT) && job.bs % DD_SECTOR != 0) {
+    fprintf(stderr, "dd: bs must be a multiple of %d for direct I/O\n", DD_SECTOR);
+    return -1;
+  }
+
+  if (input != NULL && (job.in = open(input, in_flags)) == -1) {
+    fprintf(stderr, "dd: Cannot open %s. %s.\n", input, strerror(errno));
+    return -1;
+  }
+  if (output != NULL && (job.out = open(output, out_flags, 0666)) == -1) {
+    fprintf(stderr, "dd: Cannot open %s. %s.\n", output, strerror(errno));
+    if (input != NULL)
+      close(job.in);
+    return -1;
+  }
+  if (output != NULL && (out_flags & O_DIRECT) &&
+      (job.out_buffered = open(output, O_WRONLY | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "dd: Cannot open %s. %s.\n", output, strerror(errno));
+    atomic_store(&job.failed, errno);
+  }
+  // Like dd, a regular output file ends where the copy starts writing. The
+  // shell's own output is never truncated, and is written from where it is.
+  if (output != NULL && fstat(job.out, &stats) == 0 &&
+      (S_ISREG(stats.st_mode) || S_ISBLK(stats.st_mode))) {
+    if (S_ISREG(stats.st_mode) && ftruncate(job.out, job.seek * job.bs) == -1) {
+      fprintf(stderr, "dd: Cannot truncate %s. %s.\n", output, strerror(errno));
+      atomic_store(&job.failed, errno);
+    }
+    seekable = true;
+  }
+
+  // Offsets can only be used when the input size is known as well
+  if (seekable && fstat(job.in, &stats) == 0 &&
+      (S_ISREG(stats.st_mode) || S_ISBLK(stats.st_mode))) {
+    unsigned long long size = stats.st_size;
+    long long available;
+
+    if (S_ISBLK(stats.st_mode))
+      ioctl(job.in, BLKGETSIZE64, &size);
+    available = ((long long) size + job.bs - 1) / job.bs - job.skip;
+    if (available < 0)
+      available = 0;
+    if (job.blocks < 0 || job.blocks > available)
+      job.blocks = available;
+    offsets = true;
+  } else if (job.skip > 0 &&
+             lseek(job.in, job.skip * job.bs, SEEK_CUR) == -1) {
+    fprintf(stderr, "dd: Cannot skip input. %s.\n", strerror(errno));
+    atomic_store(&job.failed, errno);
+  }
+  if (!offsets && job.seek > 0 && lseek(job.out, job.seek * job.bs, SEEK_CUR) == -1) {
+    fprintf(stderr, "dd: Cannot seek output. %s.\n", strerror(errno));
+    atomic_store(&job.failed, errno);
+  }
+
+  fflush(stdout);
+  ioprio = begin_throttle(&t);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (atomic_load(&job.failed) == 0 && !offsets)
+    dd_sequential(&job);
+  else if (atomic_load(&job.failed) == 0) {
+    while (spawned < workers - 1 &&
+           pthread_create(&threads[spawned], NULL, dd_worker, &job) == 0)
+      spawned++;
+    dd_worker(&job);
+    while (spawned > 0)
+      pthread_join(threads[--spawned], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end_throttle(ioprio);
+
+  if (input != NULL)
+    close(job.in);
+  if (output != NULL)
+    close(job.out);
+  if (job.out_buffered != -1)
+    close(job.out_buffered);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%lld bytes copied, %.3f s, %.1f MB/s\n",
+          (long long) atomic_load(&job.copied), seconds,
+          seconds > 0 ? atomic_load(&job.copied) / seconds / 1e6 : 0.0);
+  if (atomic_load(&job.failed) != 0) {
+    fprintf(stderr, "dd: Copy failed. %s.\n", strerror(atomic_load(&job.failed)));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Copies a byte range between files inside the kernel with
+ *         copy_file_range(2), falling back to pread/pwrite where the
+ *         filesystems involved do not support it
+ * @param  Source descriptor
+ * @param  Offset of the range in the source
+ * @param  Destination descriptor, written from its current offset
+ * @param  Number of bytes to copy
+ * @return -1 on error, 0 on success
+ */
+int copy_range(int in, off_t offset, int out, off_t length) {
+  char data[TEE_CHUNK];
+
+  while (length > 0) {
+    ssize_t n = copy_file_range(in, &offset, out, NULL, length, 0);
+    if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP)) {
+      n = pread(in, data, length < (off_t) sizeof(data) ? length : (off_t) sizeof(data), offset);
+      if (n > 0 && write_all(out, data, n) == -1)
+        return -1;
+      offset += n > 0 ? n : 0;
+    }
+    if (n == -1)
+      return -1;
+    if (n == 0) {
+      errno = EIO;
+      return -1;
+    }
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+ * @brief  split worker. Claims chunks one at a time and writes each to its
+ *         own output file with in-kernel range copies.
+ * @param  The split_job
+ * @return Always NULL
+ */
+void* split_worker(void* arg) {
+  struct split_job* job = arg;
+  char name[MAX_PATH_LENGTH];
+  int i;
+
+  while (!atomic_load(&job->failed) && (i = atomic_fetch_add(&job->next, 1)) < job->chunks) {
+    int length = snprintf(name, sizeof(name), "%s", job->prefix);
+    int out;
+
+    for (int j = job->suffix_length - 1, n = i; j >= 0; j--, n /= 26)
+      name[length + j] = 'a' + n % 26;
+    name[length + job->suffix_length] = 0;
+
+    if ((out = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1 ||
+        copy_range(job->in, job->starts[i], out, job->starts[i + 1] - job->starts[i]) == -1) {
+      fprintf(stderr, "split: Cannot write %s. %s.\n", name, strerror(errno));
+      atomic_store(&job->failed, 1);
+    }
+    if (out != -1)
+      close(out);
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Finds where each chunk of a line-based split starts. The file is
+ *         mapped and newlines are located with memchr, which glibc
+ *         vectorizes, so only the boundaries are computed in user space.
+ * @param  Descriptor of the file
+ * @param  Size of the file
+ * @param  Lines per chunk
+ * @param  Receives the number of chunks
+ * @return Array of chunk start offsets followed by the file size, or NULL
+ */
+off_t* split_by_lines(int fd, off_t size, long long lines, int* chunks) {
+  const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  const char* end = data + size;
+  const char* p = data;
+  off_t* starts = NULL;
+  int capacity = 0;
+
+  if (data == MAP_FAILED)
+    return NULL;
+  madvise((void*) data, size, MADV_SEQUENTIAL);
+  *chunks = 0;
+  while (p < end) {
+    if (*chunks + 1 >= capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      starts = realloc(starts, capacity * sizeof(off_t));
+    }
+    starts[(*chunks)++] = p - data;
+    for (long long n = 0; n < lines && p < end; n++) {
+      const char* newline = memchr(p, '\n', end - p);
+      p = newline ? newline + 1 : end;
+    }
+  }
+  munmap((void*) data, size);
+  if (starts == NULL)
+    starts = malloc(sizeof(off_t));
+  starts[*chunks] = size;
+  return starts;
+}
+
+/**
+ * @brief  Splits a file into pieces named PREFIXaa, PREFIXab, ... either
+ *         every SIZE bytes or every N lines. Pieces are copied with
+ *         copy_file_range and written in parallel.
+ * @param  Argument count
+ * @param  Arguments: [-b SIZE | -l LINES] file [prefix]
+ * @return -1 on error, 0 on success
+ */
+int do_split(int argc, char** argv) {
+  struct split_job job = { .prefix = "x", .suffix_length = 2 };
+  pthread_t threads[MAX_WORKERS];
+  long long bytes = 0, lines = SPLIT_DEFAULT_LINES;
+  struct stat stats;
+  int spawned = 0;
+  int first = 1;
+
+  invalidate_metadata();
+  if (argc > 2 && !strcmp(argv[1], "-b"))
+    first = parse_size(argv[2], &bytes) == -1 || bytes == 0 ? -1 : 3;
+  else if (argc > 2 && !strcmp(argv[1], "-l"))
+    first = parse_size(argv[2], &lines) == -1 || lines == 0 ? -1 : 3;
+  if (first == -1 || argc - first < 1 || argc - first > 2) {
+    fprintf(stderr, "split: Usage: split [-b SIZE | -l LINES] file [prefix]\n");
+    return -1;
+  }
+  if (argc - first == 2)
+    job.prefix = argv[first + 1];
+
+  if ((job.in = open(argv[first], O_RDONLY | O_CLOEXEC)) == -1 ||
+      fstat(job.in, &stats) == -1) {
+    fprintf(stderr, "split: Cannot open %s. %s.\n", argv[first], strerror(errno));
+    if (job.in != -1)
+      close(job.in);
+    return -1;
+  }
+
+  if (bytes > 0) {
+    job.chunks = (stats.st_size + bytes - 1) / bytes;
+    job.starts = malloc((job.chunks + 1) * sizeof(off_t));
+    for (int i = 0; i < job.chunks; i++)
+      job.starts[i] = i * bytes;
+    job.starts[job.chunks] = stats.st_size;
+  } else if (stats.st_size > 0)
+    job.starts = split_by_lines(job.in, stats.st_size, lines, &job.chunks);
+  if (job.starts == NULL && stats.st_size > 0) {
+    fprintf(stderr, "split: Cannot read %s. %s.\n", argv[first], strerror(errno));
+    close(job.in);
+    return -1;
+  }
+
+  // Widen the suffix when two letters cannot name every chunk
+  for (long n = 26 * 26; n < job.chunks; n *= 26)
+    job.suffix_length++;
+  if (strlen(job.prefix) + job.suffix_length >= MAX_PATH_LENGTH) {
+    fprintf(stderr, "split: Prefix too long\n");
+    free(job.starts);
+    close(job.in);
+    return -1;
+  }
+
+  while (spawned < MAX_WORKERS && spawned < job.chunks - 1 &&
+         pthread_create(&threads[spawned], NULL, split_worker, &job) == 0)
+    spawned++;
+  split_worker(&job);
+  while (spawned > 0)
+    pthread_join(threads[--spawned], NULL);
+
+  free(job.starts);
+  close(job.in);
+  return atomic_load(&job.failed) ? -1 : 0;
+}
+
+/**
+ * @brief  Background thread recording where every line of a mapped file
+ *         starts. Newlines are found with memchr a chunk at a time, and each
+ *         chunk is published so waiters can use the index as it grows.
+ * @param  The line_index
+ * @return Always NULL
+ */
+void* index_worker(void* arg) {
+  struct line_index* index = arg;
+  off_t found[INDEX_CHUNK / 64];
+  off_t position = 0;
+
+  while (position < index->size) {
+    const char* end = index->data + (index->size - position > INDEX_CHUNK ?
+                                      position + INDEX_CHUNK : index->size);
+    const char* p = index->data + position;
+    long count = 0;
+
+    // Stop the chunk early if the local array fills up on very short lines
+    while (p < end && count < (long) (sizeof(found) / sizeof(found[0]))) {
+      const char* newline = memchr(p, '\n', end - p);
+      if (newline == NULL || newline + 1 >= index->data + index->size) {
+        p = end;
+        break;
+      }
+      p = newline + 1;
+      found[count++] = p - index->data;
+    }
+    position = p - index->data;
+
+    pthread_mutex_lock(&index->lock);
+    if (index->count + count > index->capacity) {
+      while (index->count + count > index->capacity)
+        index->capacity *= 2;
+      index->offsets = realloc(index->offsets, index->capacity * sizeof(off_t));
+    }
+    memcpy(index->offsets + index->count, found, count * sizeof(off_t));
+    index->count += count;
+    pthread_cond_broadcast(&index->grown);
+    bool stop = index->stop;
+    pthread_mutex_unlock(&index->lock);
+    if (stop)
+      break;
+  }
+
+  pthread_mutex_lock(&index->lock);
+  index->done = true;
+  pthread_cond_broadcast(&index->grown);
+  pthread_mutex_unlock(&index->lock);
+  return NULL;
+}
+
+/**
+ * @brief  Finds where a line starts, starting the background indexer on
+ *         first use and waiting only until it has reached that line
+ * @param  The line_index
+ * @param  Line number, counting from 1
+ * @return Offset of the line, or of the last line if the file is shorter
+ */
+off_t line_offset(struct line_index* index, long line) {
+  off_t offset;
+
+  pthread_mutex_lock(&index->lock);
+  if (!index->started) {
+    index->capacity = 1024;
+    index->offsets = malloc(index->capacity * sizeof(off_t));
+    index->offsets[index->count++] = 0;
+    index->started = pthread_create(&index->thread, NULL, index_worker, index) == 0;
+    index->done = !index->started;
+  }
+  while (index->count < line && !index->done)
+    pthread_cond_wait(&index->grown, &index->lock);
+  offset = index->offsets[(line < index->count ? line : index->count) - 1];
+  pthread_mutex_unlock(&index->lock);
+  return offset;
+}
+
+/**
+ * @brief  Looks up the number of the line starting at an offset, if the
+ *         index has already got that far
+ * @param  The line_index
+ * @param  Offset of a line start
+ * @return Line number counting from 1, or 0 if not known yet
+ */
+long line_number(struct line_index* index, off_t offset) {
+  long low = 0, high;
+
+  pthread_mutex_lock(&index->lock);
+  high = index->count - 1;
+  if (!index->started || index->offsets[high] < offset) {
+    pthread_mutex_unlock(&index->lock);
+    return 0;
+  }
+  while (low < high) {
+    long middle = (low + high + 1) / 2;
+    if (index->offsets[middle] <= offset)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  pthread_mutex_unlock(&index->lock);
+  return low + 1;
+}
+
+/**
+ * @brief  Finds the start of the line before the one starting at an offset
+ * @param  Mapped file
+ * @param  Offset of a line start
+ * @return Offset of the previous line start, or 0
+ */
+off_t previous_line(const char* data, off_t offset) {
+  const char* newline;
+
+  if (offset <= 1)
+    return 0;
+  newline = memrchr(data, '\n', offset - 1);
+  return newline ? newline + 1 - data : 0;
+}
+
+/**
+ * @brief  Finds the start of the line after the one starting at an offset
+ * @param  Mapped file
+ * @param  Size of the file
+ * @param  Offset of a line start
+ * @return Offset of the next line start, or the offset itself at the end
+ */
+off_t next_line(const char* data, off_t size, off_t offset) {
+  const char* newline = memchr(data + offset, '\n', size - offset);
+  return newline && newline + 1 < data + size ? newline + 1 - data : offset;
+}
+
+/**
+ * @brief  Draws one screen of the pager. Only the visible rows are looked
+ *         at, so the cost does not depend on the size of the file.
+ * @param  Mapped file
+ * @param  Size of the file
+ * @param  Offset of the first line to show
+ * @param  Terminal size
+ * @param  Line index, used for the line number in the status line
+ * @param  Name of the file
+ */
+void draw_page(const char* data, off_t size, off_t top, struct winsize* window,
+               struct line_index* index, const char* name) {
+  char status[MAX_PATH_LENGTH + 64];
+  off_t offset = top;
+  long line = line_number(index, top);
+
+  write_all(STDOUT_FILENO, "\033[H\033[2J", 7);
+  for (int row = 0; row < window->ws_row - 1 && offset < size; row++) {
+    const char* newline = memchr(data + offset, '\n', size - offset);
+    off_t length = (newline ? newline - data : size) - offset;
+
+    write_all(STDOUT_FILENO, data + offset, length < window->ws_col ? length : window->ws_col);
+    write_all(STDOUT_FILENO, "\r\n", 2);
+    offset += length + 1;
+  }
+  if (line > 0)
+    snprintf(status, sizeof(status), "\033[7m%s line %ld (%d%%)\033[0m", name, line,
+             (int) (size ? top * 100 / size : 100));
+  else
+    snprintf(status, sizeof(status), "\033[7m%s (%d%%)\033[0m", name,
+             (int) (size ? top * 100 / size : 100));
+  write_all(STDOUT_FILENO, status, strlen(status));
+}
+
+/**
+ * @brief  Pages through a file. The file is mapped rather than read, so
+ *         opening it and jumping to the end or to a percentage are
+ *         immediate; line numbers come from an index built lazily in the
+ *         background.
+ *         Keys: space/f and b page down and up, j/Enter and k move a line,
+ *         g and G go to the start and end, N g goes to line N, N % or N p
+ *         to N percent, /text searches forward, n repeats it, q quits.
+ * @param  Argument count
+ * @param  Arguments: file
+ * @return -1 on error, 0 on success
+ */
+int do_less(int argc, char** argv) {
+  struct line_index index = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                              .grown = PTHREAD_COND_INITIALIZER };
+  char pattern[SEARCH_LENGTH] = {0};
+  struct termios saved, raw;
+  struct winsize window;
+  struct stat stats;
+  off_t top = 0;
+  long count = 0;
+  char key;
+  int fd;
+
+  if (argc != 2) {
+    fprintf(stderr, "less: Usage: less file\n");
+    return -1;
+  }
+  if ((fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &stats) == -1) {
+    fprintf(stderr, "less: Cannot open %s. %s.\n", argv[1], strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  // Without a terminal to page on, behave like cat
+  if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) ||
+      ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == -1 || window.ws_row < 2) {
+    close(fd);
+    return do_cat(argv[1]);
+  }
+
+  index.size = stats.st_size;
+  index.data = stats.st_size ? mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0) : "";
+  close(fd);
+  if (index.data == MAP_FAILED) {
+    fprintf(stderr, "less: Cannot map %s. %s.\n", argv[1], strerror(errno));
+    return -1;
+  }
+
+  fflush(stdout);
+  tcgetattr(STDIN_FILENO, &saved);
+  raw = saved;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+  draw_page(index.data, index.size, top, &window, &index, argv[1]);
+  while (read(STDIN_FILENO, &key, 1) == 1 && key != 'q') {
+    int rows = window.ws_row - 1;
+    const char* match = NULL;
+
+    if (isdigit(key)) {
+      count = count * 10 + key - '0';
+      continue;
+    }
+    switch (key) {
+    case ' ': case 'f':
+      for (int i = 0; i < rows; i++)
+        top = next_line(index.data, index.size, top);
+      break;
+    case 'b':
+      for (int i = 0; i < rows; i++)
+        top = previous_line(index.data, top);
+      break;
+    case 'j': case '\n':
+      top = next_line(index.data, index.size, top);
+      break;
+    case 'k':
+      top = previous_line(index.data, top);
+      break;
+    case 'g':
+      top = count > 0 ? line_offset(&index, count) : 0;
+      break;
+    case 'G':
+      // The last screen is found by scanning back from the end, not forward
+      top = index.size;
+      for (int i = 0; i < rows; i++)
+        top = previous_line(index.data, top);
+      break;
+    case '%': case 'p':
+      top = index.size * (count > 100 ? 100 : count) / 100;
+      if (top > 0) {
+        match = memrchr(index.data, '\n', top);
+        top = match ? match + 1 - index.data : 0;
+      }
+      if (top >= index.size)
+        top = previous_line(index.data, index.size);
+      break;
+    case '/': {
+      size_t length = 0;
+
+      write_all(STDOUT_FILENO, "\r\033[K/", 5);
+      while (read(STDIN_FILENO, &key, 1) == 1 && key != '\n' &&
+             length < sizeof(pattern) - 1) {
+        if ((key == 127 || key == '\b') && length > 0)
+          length--;
+        else if (key != 127 && key != '\b')
+          pattern[length++] = key;
+        write_all(STDOUT_FILENO, &key, 1);
+      }
+      pattern[length] = 0;
+    }
+    // fall through
+    case 'n': {
+      off_t from = next_line(index.data, index.size, top);
+      size_t length = strlen(pattern);
+
+      if (length > 0 && from < index.size)
+        match = memmem(index.data + from, index.size - from, pattern, length);
+      if (match != NULL) {
+        const char* newline = memrchr(index.data, '\n', match - index.data);
+        top = newline ? newline + 1 - index.data : 0;
+      }
+      break;
+    }
+    }
+    count = 0;
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &window);
+    draw_page(index.data, index.size, top, &window, &index, argv[1]);
+  }
+
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+  write_all(STDOUT_FILENO, "\r\033[K", 4);
+  if (index.started) {
+    pthread_mutex_lock(&index.lock);
+    index.stop = true;
+    pthread_mutex_unlock(&index.lock);
+    pthread_join(index.thread, NULL);
+    free(index.offsets);
+  }
+  if (index.size > 0)
+    munmap((void*) index.data, index.size);
+  return 0;
+}
+
+/**
+ * @brief  Sets the I/O priority and rate limits applied by default to bulk
+ *         builtins (cat, rm) and their background workers
+ * @param  Argument count
+ * @param  Arguments: [--ioprio CLASS] [--rate RATE], "off" to clear, or
+ *         nothing to show the current setting
+ * @return -1 on error, 0 on success
+ */
+int do_throttle(int argc, char** argv) {
+  struct throttle t;
+
+  if (argc == 2 && !strcmp(argv[1], "off")) {
+    memset(&default_throttle, 0, sizeof(default_throttle));
+    return 0;
+  }
+  if (argc == 1) {
+    printf("ioprio: %d\nbytes/s: %.0f\nops/s: %.0f\n", default_throttle.ioprio,
+           default_throttle.bytes_per_sec, default_throttle.ops_per_sec);
+    return 0;
+  }
+  if (parse_throttle(&argc, argv, &t) == -1)
+    return -1;
+  if (argc != 1) {
+    fprintf(stderr, "throttle: Usage: throttle [--ioprio CLASS] [--rate RATE] | off\n");
+    return -1;
+  }
+  default_throttle = t;
+  return 0;
+}
+
+/**
+ * @brief  Outputs its arguments separated by spaces
+ * @param  Argument count
+ * @param  Arguments: [-n] word..., where -n leaves off the newline
+ * @return Always returns 0
+ */
+int do_echo(int argc, char** argv) {
+  bool newline = true;
+  int i = 1;
+
+  if (argc > 1 && !strcmp(argv[1], "-n")) {
+    newline = false;
+    i++;
+  }
+  for (; i < argc; i++) {
+    out_write(argv[i], strlen(argv[i]));
+    if (i < argc - 1)
+      out_char(' ');
+  }
+  if (newline)
+    out_char('\n');
+  return 0;
+}
+
+/**
+ * @brief  Adds a field to the output buffer padded to a width
+ * @param  Field text
+ * @param  Length of the text
+ * @param  Minimum width
+ * @param  Whether to pad on the right instead of the left
+ * @param  Padding character
+ */
+void out_padded(const char* text, size_t length, int width, bool left, char pad) {
+  if (!left)
+    for (int n = width - (int) length; n > 0; n--)
+      out_char(pad);
+  out_write(text, length);
+  if (left)
+    for (int n = width - (int) length; n > 0; n--)
+      out_char(' ');
+}
+
+/**
+ * @brief  Adds an integer to the output buffer, converting it with a small
+ *         local buffer rather than through stdio
+ * @param  Magnitude of the value
+ * @param  Whether the value is negative
+ * @param  Base: 8, 10 or 16
+ * @param  Whether hexadecimal digits are upper case
+ * @param  Minimum width
+ * @param  Whether to pad on the right
+ * @param  Whether to pad with zeros
+ */
+void out_integer(unsigned long long value, bool negative, int base, bool upper,
+                 int width, bool left, bool zero) {
+  const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char text[24];
+  int used = sizeof(text);
+
+  do {
+    text[--used] = digits[value % base];
+    value /= base;
+  } while (value != 0);
+
+  if (negative && zero && !left) {
+    out_char('-');
+    width--;
+  } else if (negative)
+    text[--used] = '-';
+  out_padded(text + used, sizeof(text) - used, width, left, zero && !left ? '0' : ' ');
+}
+
+/**
+ * @brief  Formats and outputs its arguments. Supports %s, %c, %d, %i, %u,
+ *         %x, %X, %o and %% with "-" and "0" flags and a width, and the
+ *         escapes \n, \t, \r and \\. The format is reused while arguments
+ *         remain, so one call can emit a line per argument.
+ * @param  Argument count
+ * @param  Arguments: format [argument...]
+ * @return -1 on error, 0 on success
+ */
+int do_printf(int argc, char** argv) {
+  int next = 2;
+
+  if (argc < 2) {
+    fprintf(stderr, "printf: Usage: printf format [argument...]\n");
+    return -1;
+  }
+  do {
+    int first = next;
+
+    for (const char* f = argv[1]; *f != 0; f++) {
+      bool left = false, zero = false;
+      const char* arg;
+      long long value;
+      int width = 0;
+
+      if (*f == '\\' && f[1] != 0) {
+        f++;
+        out_char(*f == 'n' ? '\n' : *f == 't' ? '\t' : *f == 'r' ? '\r' : *f);
+        continue;
+      }
+      if (*f != '%') {
+        out_char(*f);
+        continue;
+      }
+      if (*++f == '%') {
+        out_char('%');
+        continue;
+      }
+      for (; *f == '-' || *f == '0'; f++)
+        *f == '-' ? (left = true) : (zero = true);
+      for (; isdigit(*f); f++)
+        width = width * 10 + *f - '0';
+
+      arg = next < argc ? argv[next++] : "";
+      switch (*f) {
+      case 's':
+        out_padded(arg, strlen(arg), width, left, ' ');
+        break;
+      case 'c':
+        out_padded(arg, *arg ? 1 : 0, width, left, ' ');
+        break;
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+        value = strtoll(arg, NULL, 0);
+        if (*f == 'd' || *f == 'i')
+          out_integer(value < 0 ? -(unsigned long long) value : (unsigned long long) value,
+                      value < 0, 10, false, width, left, zero);
+        else
+          out_integer((unsigned long long) value, false,
+                      *f == 'o' ? 8 : *f == 'u' ? 10 : 16, *f == 'X', width, left, zero);
+        break;
+      default:
+        out_flush();
+        fprintf(stderr, "printf: %%%c: Invalid conversion\n", *f ? *f : ' ');
+        return -1;
+      }
+      if (*f == 0)
+        break;
+    }
+    // Stop once a pass of the format consumes no arguments
+    if (next == first)
+      break;
+  } while (next < argc);
+  return 0;
+}
+
+/**
+ * @brief  Opens a directory for path resolution, using openat2 so magic
+ *         /proc links are not followed where the kernel supports it
+ * @param  Directory to open
+ * @return O_PATH descriptor, or -1 on error
+ */
+int open_resolved(const char* path) {
+#ifdef SYS_openat2
+  struct open_how how = { .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+                          .resolve = RESOLVE_NO_MAGICLINKS };
+  int fd = syscall(SYS_openat2, AT_FDCWD, path, &how, sizeof(how));
+
+  if (fd != -1 || errno != ENOSYS)
+    return fd;
+#endif
+  return open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * @brief  Resolves a path with realpath(3), which needs a PATH_MAX buffer,
+ *         and copies the answer only if it fits
+ * @param  Path to resolve
+ * @param  Buffer of MAX_PATH_LENGTH bytes receiving the canonical path
+ * @return -1 on error, 0 on success
+ */
+int resolve_path(const char* path, char* canonical) {
+  char* resolved = realpath(path, NULL);
+
+  if (resolved == NULL)
+    return -1;
+  if (strlen(resolved) >= MAX_PATH_LENGTH) {
+    free(resolved);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(canonical, resolved);
+  free(resolved);
+  return 0;
+}
+
+/**
+ * @brief  Canonicalizes a directory through the prefix cache. A cached entry
+ *         is checked with one stat of the written path, comparing device and
+ *         inode, instead of resolving every component again.
+ * @param  Absolute path of the directory as written
+ * @param  Buffer of MAX_PATH_LENGTH bytes receiving the canonical path
+ * @return -1 on error, 0 on success
+ */
+int canonical_directory(const char* path, char* canonical) {
+  char link[32];
+  unsigned int hash = 2166136261u;
+  struct prefix_entry* entry;
+  struct stat stats;
+  ssize_t length;
+  int fd;
+
+  for (const char* p = path; *p != 0; p++)
+    hash = (hash ^ (unsigned char) *p) * 16777619u;
+  entry = &prefix_cache[hash % PREFIX_CACHE_SIZE];
+
+  if (!strcmp(entry->path, path)) {
+    if (stat(path, &stats) == -1)
+      return -1;
+    if (stats.st_dev == entry->dev && stats.st_ino == entry->ino) {
+      strcpy(canonical, entry->canonical);
+      return 0;
+    }
+  }
+
+  // Let the kernel resolve the whole path once and report where it ended up
+  if ((fd = open_resolved(path)) == -1)
+    return -1;
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  length = readlink(link, canonical, MAX_PATH_LENGTH);
+  if (length == -1 || length == MAX_PATH_LENGTH || fstat(fd, &stats) == -1) {
+    // Without /proc, or with an answer too long to trust, resolve without
+    // caching
+    close(fd);
+    return resolve_path(path, canonical);
+  }
+  close(fd);
+  canonical[length] = 0;
+
+  // Fill the slot only with a key that fits whole
+  if (strlen(path) >= sizeof(entry->path))
+    return 0;
+  strcpy(entry->path, path);
+  strcpy(entry->canonical, canonical);
+  entry->dev = stats.st_dev;
+  entry->ino = stats.st_ino;
+  return 0;
+}
+
+/**
+ * @brief  Outputs the canonical absolute path of each name, with symlinks,
+ *         "." and ".." resolved. The directory part of each name goes
+ *         through the prefix cache, so names in the same tree share the
+ *         work, and only the last component is examined separately.
+ * @param  Argument count
+ * @param  Arguments: name...
+ * @return -1 if any name could not be resolved, 0 on success
+ */
+int do_realpath(int argc, char** argv) {
+  char cwd[MAX_PATH_LENGTH];
+  int result = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "realpath: Usage: realpath name...\n");
+    return -1;
+  }
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    cwd[0] = 0;
+
+  for (int i = 1; i < argc; i++) {
+    char absolute[2 * MAX_PATH_LENGTH];
+    char canonical[MAX_PATH_LENGTH];
+    char resolved[2 * MAX_PATH_LENGTH];
+    const char* base;
+    struct stat stats;
+    size_t length;
+
+    if (argv[i][0] == '/')
+      snprintf(absolute, sizeof(absolute), "%s", argv[i]);
+    else
+      snprintf(absolute, sizeof(absolute), "%s/%s", cwd, argv[i]);
+    length = strlen(absolute);
+    while (length > 1 && absolute[length - 1] == '/')
+      absolute[--length] = 0;
+
+    base = strrchr(absolute, '/') + 1;
+    if (length >= MAX_PATH_LENGTH) {
+      errno = ENAMETOOLONG;
+    } else if (!strcmp(base, ".") || !strcmp(base, "..") || length == 1) {
+      // Nothing to split off; resolve the whole name as a directory
+      if (canonical_directory(absolute, canonical) == 0) {
+        out_write(canonical, strlen(canonical));
+        out_char('\n');
+        continue;
+      }
+    } else {
+      absolute[base - absolute - (base - absolute > 1)] = 0;
+      if (canonical_directory(absolute, canonical) == 0) {
+        snprintf(resolved, sizeof(resolved), "%s/%s",
+                 strcmp(canonical, "/") ? canonical : "", base);
+        // Like realpath(1), the last component need not exist, but a
+        // symlink there still needs full resolution
+        if (lstat(resolved, &stats) == -1) {
+          if (errno != ENOENT)
+            goto failed;
+        } else if (S_ISLNK(stats.st_mode)) {
+          if (resolve_path(resolved, canonical) == -1)
+            goto failed;
+          snprintf(resolved, sizeof(resolved), "%s", canonical);
+        }
+        out_write(resolved, strlen(resolved));
+        out_char('\n');
+        continue;
+      }
+    }
+failed:
+    out_flush();
+    fprintf(stderr, "realpath: %s: %s\n", argv[i], strerror(errno));
+    result = -1;
+  }
+  return result;
+}
+
+/**
+ * @brief  Finds the last component of a name without copying it
+ * @param  Name
+ * @param  Receives the length of the component
+ * @return Start of the component within the name
+ */
+const char* last_component(const char* name, size_t* length) {
+  size_t end = strlen(name);
+  size_t start;
+
+  while (end > 1 && name[end - 1] == '/')
+    end--;
+  start = end;
+  while (start > 0 && name[start - 1] != '/')
+    start--;
+  // A name made only of slashes is the root directory
+  if (start == end && end > 0)
+    start = end - 1;
+  *length = end - start;
+  return name + start;
+}
+
+/**
+ * @brief  Outputs the last component of a name, optionally without a suffix.
+ *         The answer is written straight from the argument, not copied.
+ * @param  Argument count
+ * @param  Arguments: name [suffix]
+ * @return -1 on error, 0 on success
+ */
+int do_basename(int argc, char** argv) {
+  const char* base;
+  size_t length;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "basename: Usage: basename name [suffix]\n");
+    return -1;
+  }
+  base = last_component(argv[1], &length);
+  if (argc == 3) {
+    size_t suffix = strlen(argv[2]);
+    if (suffix < length && !strncmp(base + length - suffix, argv[2], suffix))
+      length -= suffix;
+  }
+  out_write(base, length);
+  out_char('\n');
+  return 0;
+}
+
+/**
+ * @brief  Outputs each name with its last component removed. The answer is
+ *         written straight from the argument, not copied.
+ * @param  Argument count
+ * @param  Arguments: name...
+ * @return -1 on error, 0 on success
+ */
+int do_dirname(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "dirname: Usage: dirname name...\n");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++) {
+    size_t length;
+    const char* base = last_component(argv[i], &length);
+    size_t end = base - argv[i];
+
+    while (end > 1 && argv[i][end - 1] == '/')
+      end--;
+    if (end == 0)
+      out_write(argv[i][0] == '/' ? "/" : ".", 1);
+    else
+      out_write(argv[i], end);
+    out_char('\n');
+  }
+  return 0;
+}
+
+/**
+ * @brief  Parses an unsigned decimal field of a /proc file
+ * @param  Text positioned at or before the field
+ * @param  Receives the value; a leading minus sign is skipped
+ * @return Text following the field
+ */
+const char* parse_field(const char* text, unsigned long long* value) {
+  *value = 0;
+  while (*text == ' ')
+    text++;
+  if (*text == '-')
+    text++;
+  while (*text >= '0' && *text <= '9')
+    *value = *value * 10 + (*text++ - '0');
+  return text;
+}
+
+/**
+ * @brief  Fills in a process from the contents of its stat file. The
+ *         command name is in parentheses and may itself contain spaces and
+ *         parentheses, so fields are counted from the last ')'.
+ * @param  Process to fill in
+ * @param  Contents of /proc/PID/stat, NUL terminated
+ * @return -1 if the contents are malformed, 0 on success
+ */
+int parse_stat(struct process* process, const char* text) {
+  const char* open = strchr(text, '(');
+  const char* close = strrchr(text, ')');
+  unsigned long long value;
+
+  if (open == NULL || close == NULL || close < open || close[1] == 0)
+    return -1;
+  if (process->command[0] == 0)
+    snprintf(process->command, sizeof(process->command), "[%.*s]",
+             (int) (close - open - 1), open + 1);
+  text = close + 2;
+  process->state = *text++;
+  process->ticks = 0;
+  for (int field = 4; field <= 24 && *text != 0; field++) {
+    text = parse_field(text, &value);
+    switch (field) {
+    case 4:  process->ppid = value; break;
+    case 14: case 15: process->ticks += value; break;
+    case 20: process->threads = value; break;
+    case 24: process->rss = value; break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief  Reads the command line of a process, with its arguments joined by
+ *         spaces. Kernel threads have none and keep their bracketed name.
+ * @param  Descriptor of /proc
+ * @param  Process
+ */
+void read_command_line(int proc, struct process* process) {
+  char path[32];
+  char text[COMMAND_LENGTH];
+  ssize_t length;
+  int fd;
+
+  snprintf(path, sizeof(path), "%d/cmdline", process->pid);
+  if ((fd = openat(proc, path, O_RDONLY | O_CLOEXEC)) == -1)
+    return;
+  length = pread(fd, text, sizeof(text) - 1, 0);
+  close(fd);
+  while (length > 0 && text[length - 1] == 0)
+    length--;
+  if (length <= 0)
+    return;
+  for (ssize_t i = 0; i < length; i++)
+    if (text[i] == 0 || text[i] == '\n')
+      text[i] = ' ';
+  memcpy(process->command, text, length);
+  process->command[length] = 0;
+}
+
+/**
+ * @brief  Compares process ids for qsort
+ * @param  First id
+ * @param  Second id
+ * @return Negative, zero or positive
+ */
+int compare_pids(const void* a, const void* b) {
+  pid_t left = *(const pid_t*) a;
+  pid_t right = *(const pid_t*) b;
+
+  return (left > right) - (left < right);
+}
+
+/**
+ * @brief  Closes the stat files of all known processes and forgets them
+ */
+void forget_processes(void) {
+  for (size_t i = 0; i < process_count; i++)
+    if (processes[i].fd != -1)
+      close(processes[i].fd);
+  free(processes);
+  processes = NULL;
+  process_count = 0;
+}
+
+/**
+ * @brief  Brings the process table up to date. /proc is listed with raw
+ *         getdents64 calls into a large buffer, and the sorted process ids
+ *         are merged with the previous table, so processes seen before keep
+ *         their open stat file and command line and only new ones are
+ *         opened.
+ * @param  Descriptor of /proc
+ * @param  Whether to keep stat files open for the next refresh
+ * @return -1 on error, 0 on success
+ */
+int scan_processes(int proc, bool keep) {
+  static char entries[PROC_BUFFER_SIZE];
+  struct process* next;
+  pid_t* pids = NULL;
+  size_t count = 0, capacity = 0, kept = 0, old = 0;
+  long read_bytes;
+
+  if (lseek(proc, 0, SEEK_SET) == -1)
+    return -1;
+  while ((read_bytes = syscall(SYS_getdents64, proc, entries, sizeof(entries))) > 0) {
+    for (long offset = 0; offset < read_bytes; ) {
+      struct dirent64* entry = (struct dirent64*) (entries + offset);
+      const char* name = entry->d_name;
+      pid_t pid = 0;
+
+      offset += entry->d_reclen;
+      if (*name < '1' || *name > '9')
+        continue;
+      while (*name >= '0' && *name <= '9')
+        pid = pid * 10 + (*name++ - '0');
+      if (count == capacity) {
+        pid_t* grown = realloc(pids, (capacity = capacity ? capacity * 2 : 1024) * sizeof(pid_t));
+        if (grown == NULL) {
+          free(pids);
+          return -1;
+        }
+        pids = grown;
+      }
+      pids[count++] = pid;
+    }
+  }
+  if (read_bytes == -1 || (next = malloc((count ? count : 1) * sizeof(*next))) == NULL) {
+    free(pids);
+    return -1;
+  }
+  qsort(pids, count, sizeof(pid_t), compare_pids);
+
+  for (size_t i = 0; i < count; i++) {
+    struct process* process = &next[kept];
+    char text[1024];
+    ssize_t length;
+    int fd;
+
+    while (old < process_count && processes[old].pid < pids[i]) {
+      if (processes[old].fd != -1)
+        close(processes[old].fd);
+      old++;
+    }
+    if (old < process_count && processes[old].pid == pids[i]) {
+      *process = processes[old++];
+      process->previous = process->ticks;
+    } else {
+      struct stat stats;
+
+      snprintf(text, sizeof(text), "%d/stat", pids[i]);
+      memset(process, 0, sizeof(*process));
+      process->pid = pids[i];
+      process->fd = keep ? openat(proc, text, O_RDONLY | O_CLOEXEC) : -1;
+      if (keep && process->fd == -1 && errno != EMFILE && errno != ENFILE)
+        continue;
+      // /proc/PID belongs to the effective user of the process
+      snprintf(text, sizeof(text), "%d", pids[i]);
+      if (fstatat(proc, text, &stats, 0) == 0)
+        process->uid = stats.st_uid;
+      read_command_line(proc, process);
+    }
+
+    if ((fd = process->fd) == -1) {
+      snprintf(text, sizeof(text), "%d/stat", pids[i]);
+      fd = openat(proc, text, O_RDONLY | O_CLOEXEC);
+    }
+    length = fd == -1 ? -1 : pread(fd, text, sizeof(text) - 1, 0);
+    if (fd != process->fd && fd != -1)
+      close(fd);
+    if (length > 0) {
+      bool fresh = process->previous == 0 && process->ticks == 0;
+      text[length] = 0;
+      if (parse_stat(process, text) == 0) {
+        if (fresh)
+          process->previous = process->ticks;
+        kept++;
+        continue;
+      }
+    }
+    // The process exited while being examined
+    if (process->fd != -1)
+      close(process->fd);
+  }
+  for (; old < process_count; old++)
+    if (processes[old].fd != -1)
+      close(processes[old].fd);
+
+  free(pids);
+  free(processes);
+  processes = next;
+  process_count = kept;
+  return 0;
+}
+
+/**
+ * @brief  Finds the name of a user, remembering recent answers since most
+ *         processes belong to a handful of users
+ * @param  User id
+ * @return Name, or the id as text
+ */
+const char* user_name(uid_t uid) {
+  static struct { uid_t uid; bool known; char name[16]; } names[16];
+  int slot = uid % 16;
+
+  if (!names[slot].known || names[slot].uid != uid) {
+    struct passwd* user = getpwuid(uid);
+    if (user != NULL)
+      snprintf(names[slot].name, sizeof(names[slot].name), "%s", user->pw_name);
+    else
+      snprintf(names[slot].name, sizeof(names[slot].name), "%u", uid);
+    names[slot].uid = uid;
+    names[slot].known = true;
+  }
+  return names[slot].name;
+}
+
+/**
+ * @brief  Outputs one line of the process listing
+ * @param  Process
+ * @param  Percentage of a processor used, or negative to leave it out
+ * @param  Widest the line may be, or 0 for no limit
+ */
+void print_process(const struct process* process, double cpu, int width) {
+  static long page_kb = 0;
+  static long hz = 0;
+  unsigned long long seconds;
+  const char* user = user_name(process->uid);
+  size_t length = strlen(process->command);
+  int used;
+
+  if (hz == 0) {
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    hz = sysconf(_SC_CLK_TCK);
+  }
+  seconds = process->ticks / hz;
+  out_integer(process->pid, false, 10, false, 7, false, false);
+  out_integer(process->ppid, false, 10, false, 7, false, false);
+  out_char(' ');
+  out_padded(user, strlen(user), 9, true, ' ');
+  out_char(process->state);
+  out_integer(process->rss * page_kb, false, 10, false, 9, false, false);
+  out_integer(process->threads, false, 10, false, 5, false, false);
+  if (cpu >= 0) {
+    out_integer((unsigned long long) cpu, false, 10, false, 5, false, false);
+    out_char('.');
+    out_integer((unsigned long long) (cpu * 10) % 10, false, 10, false, 1, false, false);
+  }
+  out_integer(seconds / 60, false, 10, false, 6, false, false);
+  out_char(':');
+  out_integer(seconds % 60, false, 10, false, 2, false, true);
+  out_char(' ');
+  // Everything before the command takes 49 columns, or 56 with %CPU
+  used = cpu >= 0 ? 56 : 49;
+  if (width > 0 && length > (size_t) (width > used ? width - used : 0))
+    length = width > used ? width - used : 0;
+  out_write(process->command, length);
+  out_char('\n');
+}
+
+/**
+ * @brief  Compares processes by processor time used since the previous
+ *         refresh, most first, for qsort
+ * @param  First process
+ * @param  Second process
+ * @return Negative, zero or positive
+ */
+int compare_activity(const void* a, const void* b) {
+  const struct process* left = *(struct process* const*) a;
+  const struct process* right = *(struct process* const*) b;
+  unsigned long long used_left = left->ticks - left->previous;
+  unsigned long long used_right = right->ticks - right->previous;
+
+  if (used_left != used_right)
+    return used_left < used_right ? 1 : -1;
+  return (left->pid > right->pid) - (left->pid < right->pid);
+}
+
+/**
+ * @brief  Redraws the top view until q is pressed
+ * @param  Descriptor of /proc
+ * @param  Seconds between refreshes
+ */
+void watch_processes(int proc, int interval) {
+  struct termios saved, raw;
+  struct timespec then, now;
+  struct process** order = NULL;
+  const char* header = "    PID   PPID USER     S      RSS  THR   %CPU     TIME COMMAND\n";
+  struct pollfd waits = { .fd = STDIN_FILENO, .events = POLLIN };
+  long hz = sysconf(_SC_CLK_TCK);
+  char key = 0;
+
+  fflush(stdout);
+  tcgetattr(STDIN_FILENO, &saved);
+  raw = saved;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+  clock_gettime(CLOCK_MONOTONIC, &then);
+  while (key != 'q') {
+    struct winsize window = { .ws_row = 24, .ws_col = 80 };
+    struct process** grown;
+    unsigned long long total = 0;
+    double elapsed;
+    long threads = 0;
+
+    if (scan_processes(proc, true) == -1)
+      break;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - then.tv_sec) + (now.tv_nsec - then.tv_nsec) / 1e9;
+    then = now;
+    if ((grown = realloc(order, (process_count ? process_count : 1) * sizeof(*order))) == NULL)
+      break;
+    order = grown;
+    for (size_t i = 0; i < process_count; i++) {
+      order[i] = &processes[i];
+      threads += processes[i].threads;
+      total += processes[i].ticks - processes[i].previous;
+    }
+    qsort(order, process_count, sizeof(*order), compare_activity);
+
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &window);
+    out_write("\033[H\033[2J", 7);
+    out_integer(process_count, false, 10, false, 0, false, false);
+    out_write(" processes, ", 12);
+    out_integer(threads, false, 10, false, 0, false, false);
+    out_write(" threads, ", 10);
+    out_integer(elapsed > 0 ? total * 100 / (hz * elapsed) : 0, false, 10, false, 0, false, false);
+    out_write("% cpu\n", 6);
+    out_write(header, strlen(header));
+    for (size_t i = 0; i + 3 < window.ws_row && i < process_count; i++) {
+      struct process* process = order[i];
+      double cpu = elapsed > 0 ? (process->ticks - process->previous) * 100.0 / (hz * elapsed) : 0;
+      print_process(process, cpu, window.ws_col);
+    }
+    out_flush();
+    // Wait out the interval with poll(2), since VTIME cannot exceed 25.5 s
+    waits.revents = 0;
+    if (poll(&waits, 1, interval * 1000) == -1 && errno != EINTR)
+      break;
+    if ((waits.revents & POLLIN) && read(STDIN_FILENO, &key, 1) != 1)
+      break;
+  }
+
+  free(order);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+}
+
+/**
+ * @brief  Lists processes. With --top the list is redrawn every few seconds,
+ *         busiest first, reusing the open /proc files between refreshes.
+ * @param  Argument count
+ * @param  Arguments: [--top [seconds]]
+ * @return -1 on error, 0 on success
+ */
+int do_ps(int argc, char** argv) {
+  const char* header = "    PID   PPID USER     S      RSS  THR     TIME COMMAND\n";
+  bool top = take_flag(&argc, argv, "--top");
+  int interval = 2;
+  struct rlimit limit, saved;
+  int proc;
+
+  if (argc > 2 || (argc == 2 && (!top || (interval = atoi(argv[1])) <= 0 ||
+                                  interval > INT_MAX / 1000))) {
+    fprintf(stderr, "ps: Usage: ps [--top [seconds]]\n");
+    return -1;
+  }
+  if ((proc = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "ps: Cannot open /proc. %s.\n", strerror(errno));
+    return -1;
+  }
+
+  if (top && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+    // Keeping a stat file open per process needs more than the usual limit
+    bool raised = getrlimit(RLIMIT_NOFILE, &saved) == 0 && saved.rlim_cur < saved.rlim_max;
+
+    if (raised) {
+      limit = saved;
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    watch_processes(proc, interval);
+    // Close the stat files before the limit goes back down
+    forget_processes();
+    if (raised)
+      setrlimit(RLIMIT_NOFILE, &saved);
+  } else if (scan_processes(proc, false) == -1) {
+    fprintf(stderr, "ps: Cannot read /proc. %s.\n", strerror(errno));
+    close(proc);
+    return -1;
+  } else {
+    out_write(header, strlen(header));
+    for (size_t i = 0; i < process_count; i++)
+      print_process(&processes[i], -1, 0);
+  }
+
+  forget_processes();
+  close(proc);
+  return 0;
+}
+
+/**
+ * @brief  Drops one reference to a df probe, freeing it with the last one.
+ *         Called with df_lock held.
+ * @param  Probe
+ */
+void release_probe(struct df_probe* probe) {
+  if (--probe->refs == 0)
+    free(probe);
+}
+
+/**
+ * @brief  Worker running statfs on one mount. It may never return if the
+ *         filesystem is hung; nothing waits for it without a deadline.
+ * @param  Probe to fill in
+ * @return NULL
+ */
+void* probe_worker(void* arg) {
+  struct df_probe* probe = arg;
+  struct statvfs stats;
+  int error = statvfs(probe->target, &stats) == -1 ? errno : 0;
+
+  pthread_mutex_lock(&df_lock);
+  probe->stats = stats;
+  probe->error = error;
+  probe->done = true;
+  clock_gettime(CLOCK_MONOTONIC, &probe->finished);
+  pthread_cond_broadcast(&df_finished);
+  release_probe(probe);
+  pthread_mutex_unlock(&df_lock);
+  return NULL;
+}
+
+/**
+ * @brief  Finds the probe for a mount point, starting a new one if there is
+ *         none or its answer is older than DF_CACHE_MS. Called with df_lock
+ *         held.
+ * @param  Mount point
+ * @param  Current CLOCK_MONOTONIC time
+ * @return The probe, or NULL if one could not be started
+ */
+struct df_probe* start_probe(const char* target, const struct timespec* now) {
+  struct df_probe* probe;
+  struct df_probe** grown;
+  pthread_t worker;
+  int i;
+
+  for (i = 0; i < df_probe_count; i++)
+    if (!strcmp(df_probes[i]->target, target))
+      break;
+  if (i < df_probe_count) {
+    probe = df_probes[i];
+    // A probe still running is either in flight or hung; never stack another
+    if (!probe->done || (now->tv_sec - probe->finished.tv_sec) * 1000 +
+        (now->tv_nsec - probe->finished.tv_nsec) / 1000000 < DF_CACHE_MS)
+      return probe;
+    release_probe(probe);
+    df_probes[i] = df_probes[--df_probe_count];
+  }
+
+  if ((probe = calloc(1, sizeof(*probe))) == NULL)
+    return NULL;
+  if ((grown = realloc(df_probes, (df_probe_count + 1) * sizeof(*df_probes))) == NULL) {
+    free(probe);
+    return NULL;
+  }
+  df_probes = grown;
+  snprintf(probe->target, sizeof(probe->target), "%s", target);
+  probe->refs = 2;
+  if (pthread_create(&worker, NULL, probe_worker, probe) != 0) {
+    free(probe);
+    return NULL;
+  }
+  pthread_detach(worker);
+  df_probes[df_probe_count++] = probe;
+  return probe;
+}
+
+/**
+ * @brief  Reports space on mounted filesystems. The mount table is read
+ *         once and every mount is examined at the same time on its own
+ *         worker, so the total wait is at most DF_TIMEOUT_MS however many
+ *         mounts there are. Mounts that do not answer in time, such as
+ *         unreachable NFS servers, are reported as not responding.
+ * @param  Argument count
+ * @param  Arguments: [-a] to include filesystems with no blocks
+ * @return -1 on error, 0 on success
+ */
+int do_df(int argc, char** argv) {
+  struct df_probe** probes = NULL;
+  char** sources = NULL;
+  struct timespec now, deadline;
+  struct mntent* mount;
+  bool all = take_flag(&argc, argv, "-a");
+  bool waiting = true;
+  int count = 0, result = 0;
+  FILE* table;
+
+  if (argc != 1) {
+    fprintf(stderr, "df: Usage: df [-a]\n");
+    return -1;
+  }
+  if ((table = setmntent("/proc/self/mounts", "r")) == NULL) {
+    fprintf(stderr, "df: Cannot read the mount table. %s.\n", strerror(errno));
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&df_lock);
+  while ((mount = getmntent(table)) != NULL) {
+    struct df_probe** grown_probes = realloc(probes, (count + 1) * sizeof(*probes));
+    char** grown_sources = grown_probes ? realloc(sources, (count + 1) * sizeof(*sources)) : NULL;
+
+    if (grown_probes != NULL)
+      probes = grown_probes;
+    if (grown_sources == NULL)
+      break;
+    sources = grown_sources;
+    if ((probes[count] = start_probe(mount->mnt_dir, &now)) == NULL)
+      continue;
+    // The caller holds its own reference while it waits and prints
+    probes[count]->refs++;
+    sources[count++] = strdup(mount->mnt_fsname);
+  }
+  endmntent(table);
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += DF_TIMEOUT_MS * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+  for (int i = 0; i < count && waiting; i++)
+    while (waiting && !probes[i]->done)
+      waiting = pthread_cond_timedwait(&df_finished, &df_lock, &deadline) == 0;
+
+  // Forget finished probes of filesystems that are no longer mounted
+  for (int j = 0; j < df_probe_count; j++) {
+    bool seen = false;
+
+    for (int i = 0; i < count && !seen; i++)
+      seen = probes[i] == df_probes[j];
+    if (!seen && df_probes[j]->done) {
+      release_probe(df_probes[j]);
+      df_probes[j--] = df_probes[--df_probe_count];
+    }
+  }
+
+  printf("%-20s %12s %12s %12s %4s %s\n", "Filesystem", "1K-blocks", "Used", "Available",
+         "Use%", "Mounted on");
+  for (int i = 0; i < count; i++) {
+    struct df_probe* probe = probes[i];
+    const char* source = sources[i] ? sources[i] : "?";
+
+    if (!probe->done) {
+      printf("%-20s %12s %12s %12s %4s %s (not responding)\n", source, "-", "-", "-", "-",
+             probe->target);
+      result = -1;
+    } else if (probe->error) {
+      fprintf(stderr, "df: %s: %s\n", probe->target, strerror(probe->error));
+      result = -1;
+    } else if (all || probe->stats.f_blocks > 0) {
+      unsigned long long unit = probe->stats.f_frsize ? probe->stats.f_frsize : probe->stats.f_bsize;
+      unsigned long long total = probe->stats.f_blocks * unit / 1024;
+      unsigned long long used = (probe->stats.f_blocks - probe->stats.f_bfree) * unit / 1024;
+      unsigned long long available = probe->stats.f_bavail * unit / 1024;
+
+      // Like df(1), the percentage is of the space ordinary users can have
+      printf("%-20s %12llu %12llu %12llu %3llu%% %s\n", source, total, used, available,
+             used + available ? (used * 100 + used + available - 1) / (used + available) : 0,
+             probe->target);
+    }
+    release_probe(probe);
+    free(sources[i]);
+  }
+  pthread_mutex_unlock(&df_lock);
+
+  free(probes);
+  free(sources);
+  return result;
+}
+
+/**
+ * @brief  Finds the metadata cache slot for a path, claiming it for the
+ *         path if it holds something else or is out of date
+ * @param  Path to look up
+ * @return The slot
+ */
+struct metadata_entry* metadata_slot(const char* path) {
+  unsigned long generation = atomic_load(&metadata_generation);
+  unsigned int hash = 2166136261u;
+  struct metadata_entry* entry;
+
+  for (const char* p = path; *p != 0; p++)
+    hash = (hash ^ (unsigned char) *p) * 16777619u;
+  entry = &metadata_cache[hash % METADATA_CACHE_SIZE];
+  if (entry->generation != generation || strcmp(entry->path, path) != 0) {
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->generation = generation;
+    entry->mask = 0;
+    entry->error = 0;
+    entry->access_known = 0;
+  }
+  return entry;
+}
+
+/**
+ * @brief  Gets statx fields for a path through the metadata cache. Only
+ *         the requested fields are asked of the filesystem, and a path is
+ *         not examined again until the cache is invalidated.
+ * @param  Path to examine
+ * @param  STATX_* fields needed
+ * @return The cached result; check its error field before using stats
+ */
+const struct metadata_entry* get_metadata(const char* path, unsigned int mask) {
+  struct metadata_entry* entry = metadata_slot(path);
+
+  if (entry->error == 0 && (entry->mask & mask) != mask) {
+    if (statx(AT_FDCWD, path, 0, entry->mask | mask, &entry->stats) == -1)
+      entry->error = errno;
+    else
+      entry->mask |= entry->stats.stx_mask;
+  }
+  return entry;
+}
+
+/**
+ * @brief  Checks access to a path for the effective user through the
+ *         metadata cache
+ * @param  Path to check
+ * @param  R_OK, W_OK or X_OK
+ * @return Whether access is allowed
+ */
+bool check_access(const char* path, int mode) {
+  struct metadata_entry* entry = metadata_slot(path);
+
+  if (!(entry->access_known & mode)) {
+    if (faccessat(AT_FDCWD, path, mode, AT_EACCESS) == 0)
+      entry->access_ok |= mode;
+    entry->access_known |= mode;
+  }
+  return entry->access_ok & mode;
+}
+
+/**
+ * @brief  Parses a decimal integer operand of test
+ * @param  Text to parse
+ * @param  Receives the value
+ * @return -1 on error, 0 on success
+ */
+int parse_integer(const char* text, long long* value) {
+  char* end;
+
+  errno = 0;
+  *value = strtoll(text, &end, 10);
+  if (end == text || *end != 0 || errno != 0) {
+    fprintf(stderr, "test: %s: Integer expected\n", text);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Evaluates one test primary: a unary file or string operator, a
+ *         binary comparison, or a single string
+ * @param  Operands
+ * @param  Number of operands
+ * @param  Index of the next operand, advanced past the primary
+ * @return 1 if true, 0 if false, -1 on error
+ */
+int test_primary(char** argv, int argc, int* i) {
+  static const struct { const char* op; unsigned int mask; } file_ops[] = {
+    { "-e", STATX_TYPE }, { "-f", STATX_TYPE }, { "-d", STATX_TYPE },
+    { "-s", STATX_SIZE },
+  };
+  const char* a = argv[*i];
+
+  if (*i + 2 < argc) {
+    const char* op = argv[*i + 1];
+    const char* b = argv[*i + 2];
+    long long x, y;
+
+    if (!strcmp(op, "=") || !strcmp(op, "!=")) {
+      *i += 3;
+      return (strcmp(a, b) == 0) == (op[0] == '=');
+    }
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot")) {
+      const struct metadata_entry* left = get_metadata(a, STATX_MTIME);
+      int l_error = left->error;
+      struct statx_timestamp l_time = left->stats.stx_mtime;
+      const struct metadata_entry* right = get_metadata(b, STATX_MTIME);
+      bool newer, older;
+
+      *i += 3;
+      // A missing file is older than any existing one
+      if (l_error || right->error)
+        return op[1] == 'n' ? !l_error : l_error && !right->error;
+      newer = l_time.tv_sec > right->stats.stx_mtime.tv_sec ||
+              (l_time.tv_sec == right->stats.stx_mtime.tv_sec &&
+               l_time.tv_nsec > right->stats.stx_mtime.tv_nsec);
+      older = l_time.tv_sec < right->stats.stx_mtime.tv_sec ||
+              (l_time.tv_sec == right->stats.stx_mtime.tv_sec &&
+               l_time.tv_nsec < right->stats.stx_mtime.tv_nsec);
+      return op[1] == 'n' ? newer : older;
+    }
+    if (op[0] == '-' && strlen(op) == 3 && strchr("enlg", op[1]) != NULL) {
+      *i += 3;
+      if (parse_integer(a, &x) == -1 || parse_integer(b, &y) == -1)
+        return -1;
+      if (!strcmp(op, "-eq")) return x == y;
+      if (!strcmp(op, "-ne")) return x != y;
+      if (!strcmp(op, "-lt")) return x < y;
+      if (!strcmp(op, "-le")) return x <= y;
+      if (!strcmp(op, "-gt")) return x > y;
+      if (!strcmp(op, "-ge")) return x >= y;
+      fprintf(stderr, "test: %s: Unknown operator\n", op);
+      return -1;
+    }
+  }
+
+  if (*i + 1 < argc && a[0] == '-' && a[1] != 0 && a[2] == 0) {
+    const char* path = argv[*i + 1];
+
+    *i += 2;
+    switch (a[1]) {
+    case 'z': return path[0] == 0;
+    case 'n': return path[0] != 0;
+    case 'r': return check_access(path, R_OK);
+    case 'w': return check_access(path, W_OK);
+    case 'x': return check_access(path, X_OK);
+    }
+    for (size_t j = 0; j < sizeof(file_ops) / sizeof(file_ops[0]); j++)
+      if (!strcmp(a, file_ops[j].op)) {
+        const struct metadata_entry* entry = get_metadata(path, file_ops[j].mask);
+        if (entry->error)
+          return 0;
+        switch (a[1]) {
+        case 'f': return S_ISREG(entry->stats.stx_mode);
+        case 'd': return S_ISDIR(entry->stats.stx_mode);
+        case 's': return entry->stats.stx_size > 0;
+        default:  return 1;
+        }
+      }
+    fprintf(stderr, "test: %s: Unknown operator\n", a);
+    return -1;
+  }
+
+  *i += 1;
+  return a[0] != 0;
+}
+
+/**
+ * @brief  Evaluates "!" followed by a primary
+ */
+int test_not(char** argv, int argc, int* i) {
+  int result;
+
+  if (*i < argc && !strcmp(argv[*i], "!")) {
+    (*i)++;
+    result = test_not(argv, argc, i);
+    return result == -1 ? -1 : !result;
+  }
+  if (*i >= argc) {
+    fprintf(stderr, "test: Argument expected\n");
+    return -1;
+  }
+  return test_primary(argv, argc, i);
+}
+
+/**
+ * @brief  Evaluates terms joined by -a, which binds tighter than -o
+ */
+int test_and(char** argv, int argc, int* i) {
+  int result = test_not(argv, argc, i);
+
+  while (result != -1 && *i < argc && !strcmp(argv[*i], "-a")) {
+    int right;
+    (*i)++;
+    right = test_not(argv, argc, i);
+    result = right == -1 ? -1 : result && right;
+  }
+  return result;
+}
+
+/**
+ * @brief  Evaluates terms joined by -o
+ */
+int test_or(char** argv, int argc, int* i) {
+  int result = test_and(argv, argc, i);
+
+  while (result != -1 && *i < argc && !strcmp(argv[*i], "-o")) {
+    int right;
+    (*i)++;
+    right = test_and(argv, argc, i);
+    result = right == -1 ? -1 : result || right;
+  }
+  return result;
+}
+
+/**
+ * @brief  Evaluates a conditional expression in-process. File predicates
+ *         use statx with only the fields they need and faccessat with
+ *         AT_EACCESS, both through the metadata cache, so repeated tests of
+ *         the same file in one command line cost one system call.
+ * @param  Argument count
+ * @param  Arguments: expression, followed by "]" when invoked as "["
+ * @return 0 if the expression is true, 1 if false, -1 on error
+ */
+int do_test(int argc, char** argv) {
+  int i = 1;
+  int result;
+
+  if (!strcmp(argv[0], "[")) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      fprintf(stderr, "[: Missing ]\n");
+      return -1;
+    }
+    argc--;
+  }
+  // No expression is false
+  if (argc == 1)
+    return 1;
+  result = test_or(argv, argc, &i);
+  if (result != -1 && i < argc) {
+    fprintf(stderr, "test: %s: Unexpected argument\n", argv[i]);
+    return -1;
+  }
+  return result == -1 ? -1 : !result;
+}
+
+/**
+ * @brief  Runs cd from a function body or substitution
+ * @param  Argument count
+ * @param  Arguments: [directory]
+ * @return -1 on error, 0 on success
+ */
+int builtin_cd(int argc, char** argv) {
+  char dirname[MAX_PATH_LENGTH] = {0};
+
+  // do_cd fills in the home directory, so it needs a buffer of its own
+  if (argc > 1 && strlen(argv[1]) >= sizeof(dirname)) {
+    fprintf(stderr, "cd: %s: %s\n", argv[1], strerror(ENAMETOOLONG));
+    return -1;
+  }
+  if (argc > 1)
+    snprintf(dirname, sizeof(dirname), "%s", argv[1]);
+  return do_cd(dirname);
+}
+
+/**
+ * @brief  Lists the contents of directories, or of the current directory.
+ *         --color colors names using LS_COLORS; --color=auto only does so
+ *         on a terminal.
+ * @param  Argument count
+ * @param  Arguments: [--color[=auto]] [directory...]
+ * @return -1 on error, 0 on success
+ */
+int builtin_ls(int argc, char** argv) {
+  int result = 0;
+
+  ls_color = take_flag(&argc, argv, "--color") | take_flag(&argc, argv, "--color=always");
+  if (take_flag(&argc, argv, "--color=auto"))
+    ls_color = isatty(STDOUT_FILENO);
+  if (ls_color)
+    pthread_once(&colors_once, load_colors);
+  if (argc == 1)
+    return do_ls(".");
+  for (int i = 1; i < argc; i++)
+    if (do_ls(argv[i]) == -1)
+      result = -1;
+  return result;
+}
+
+/**
+ * @brief  Removes one or more empty directories
+ * @param  Argument count
+ * @param  Arguments: name...
+ * @return -1 on error, 0 on success
+ */
+int builtin_rmdir(int argc, char** argv) {
+  int result = 0;
+
+  invalidate_metadata();
+  if (argc < 2) {
+    fprintf(stderr, "rmdir: Usage: rmdir name...\n");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++)
+    if (do_rmdir(argv[i]) == -1)
+      result = -1;
+  return result;
+}
+
+/**
+ * @brief  Argument vector wrappers for the commands taking at most one
+ *         optional argument
+ */
+int builtin_dirs(int argc, char** argv) { (void) argc; (void) argv; return do_dirs(); }
+int builtin_popd(int argc, char** argv) { (void) argc; (void) argv; return do_popd(); }
+int builtin_pwd(int argc, char** argv) { (void) argc; (void) argv; return do_pwd(); }
+int builtin_prompt(int argc, char** argv) { return do_prompt(argc > 1 ? argv[1] : ""); }
+int builtin_pushd(int argc, char** argv) { return do_pushd(argc > 1 ? argv[1] : ""); }
+
+//Exits the program
+int do_q(){
+  exit(EXIT_SUCCESS);
+}
+
+int builtin_q(int argc, char** argv) { (void) argc; (void) argv; return do_q(); }
+
+/**
+ * @brief  Checks whether a builtin writes through the output buffer
+ * @param  Builtin
+ * @return Whether it does
+ */
+bool is_buffered(builtin_handler handler) {
+  return handler == do_echo || handler == do_printf || handler == do_realpath ||
+         handler == do_basename || handler == do_dirname || handler == do_which ||
+         handler == do_ps || handler == do_file || handler == do_base64 ||
+         handler == do_jl || handler == builtin_ls;
+}
+
+/**
+ * @brief  Runs a builtin. Anything echo and printf buffered is written out
+ *         first, unless the builtin also writes through the buffer, and stdio
+ *         is flushed before those add to it, so output appears in order while
+ *         runs of them share one write.
+ * @param  Builtin to run
+ * @param  Argument count
+ * @param  Argument vector
+ * @return Return value of the builtin
+ */
+int run_handler(builtin_handler handler, int argc, char** argv) {
+  if (!is_buffered(handler))
+    out_flush();
+  else
+    fflush(stdout);
+  return handler(argc, argv);
+}
+
+static const struct builtin builtins[] = {
+  { "[",        do_test },
+  { "agg",      do_agg },
+  { "base64",   do_base64 },
+  { "basename", do_basename },
+  { "cat",      builtin_cat },
+  { "cd",       builtin_cd },
+  { "chmod",    do_chmod },
+  { "dd",       do_dd },
+  { "df",       do_df },
+  { "dirname",  do_dirname },
+  { "dirs",     builtin_dirs },
+  { "echo",     do_echo },
+  { "exit",     builtin_q },
+  { "file",     do_file },
+  { "hash",     do_hash },
+  { "jl",       do_jl },
+  { "less",     do_less },
+  { "ls",       builtin_ls },
+  { "mkdir",    builtin_mkdir },
+  { "mv",       do_mv },
+  { "popd",     builtin_popd },
+  { "printf",   do_printf },
+  { "prompt",   builtin_prompt },
+  { "ps",       do_ps },
+  { "pushd",    builtin_pushd },
+  { "pwd",      builtin_pwd },
+  { "q",        builtin_q },
+  { "realpath", do_realpath },
+  { "rm",       builtin_rm },
+  { "rmdir",    builtin_rmdir },
+  { "split",    do_split },
+  { "stat",     builtin_stat },
+  { "tee",      do_tee },
+  { "test",     do_test },
+  { "throttle", do_throttle },
+  { "touch",    do_touch },
+  { "type",     do_type },
+  { "watch",    do_watch },
+  { "which",    do_which },
+};
+
+/**
+ * @brief  Splits a command into whitespace separated words in place
+ * @param  Command to split; modified
+ * @param  Array of MAX_ARGS pointers receiving the words, NULL terminated
+ * @return Number of words
+ */
+int split_args(char* line, char** argv) {
+  char* position;
+  int argc = 0;
+
+  for (char* word = strtok_r(line, " \t", &position); word != NULL && argc < MAX_ARGS - 1;
+       word = strtok_r(NULL, " \t", &position))
+    argv[argc++] = word;
+  argv[argc] = NULL;
+  return argc;
+}
+
+/**
+ * @brief  Finds the builtin implementing a command
+ * @param  Command name
+ * @return Handler of the builtin, or NULL if there is none
+ */
+builtin_handler find_builtin(const char* name) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    if (!strcmp(name, builtins[i].name))
+      return builtins[i].handler;
+  return NULL;
+}
+
+/**
+ * @brief  Finds an alias or function by name
+ * @param  Name to look up
+ * @return The definition, or NULL if there is none
+ */
+struct shell_function* find_function(const char* name) {
+  for (int i = 0; i < function_count; i++)
+    if (!strcmp(name, functions[i].name))
+      return &functions[i];
+  return NULL;
+}
+
+/**
+ * @brief  Empties the table of resolved command names. Statistics are kept.
+ */
+void forget_commands(void) {
+  for (int i = 0; i < COMMAND_CACHE_SIZE; i++)
+    free(command_cache[i].path);
+  memset(command_cache, 0, sizeof(command_cache));
+  command_count = 0;
+}
+
+/**
+ * @brief  Searches the PATH for an executable regular file
+ * @param  Command name; used as is if it contains a slash
+ * @return Allocated path of the executable, or NULL if there is none
+ */
+char* search_path(const char* name) {
+  const char* directories = getenv("PATH");
+  char path[2 * MAX_PATH_LENGTH];
+
+  if (strchr(name, '/') != NULL)
+    directories = "";
+  else if (directories == NULL)
+    directories = "/usr/local/bin:/usr/bin:/bin";
+
+  for (const char* start = directories; ; ) {
+    const char* end = strchrnul(start, ':');
+    const struct metadata_entry* entry;
+
+    if (strchr(name, '/') != NULL)
+      snprintf(path, sizeof(path), "%s", name);
+    else
+      snprintf(path, sizeof(path), "%.*s/%s", end == start ? 1 : (int) (end - start),
+               end == start ? "." : start, name);
+    entry = get_metadata(path, STATX_TYPE);
+    if (!entry->error && S_ISREG(entry->stats.stx_mode) && check_access(path, X_OK))
+      return strdup(path);
+    if (*end == 0)
+      return NULL;
+    start = end + 1;
+  }
+}
+
+/**
+ * @brief  Resolves a command name through the command table. Names are
+ *         hashed into an open addressed table, so a name that was resolved
+ *         before costs one probe instead of a scan of every alias, function,
+ *         builtin and PATH directory.
+ * @param  Command name
+ * @param  Whether the PATH must have been searched as well
+ * @return The entry for the name
+ */
+struct command_entry* resolve_command(const char* name, bool path) {
+  unsigned int hash = 2166136261u;
+  struct command_entry* entry;
+  unsigned int slot;
+
+  for (const char* p = name; *p != 0; p++)
+    hash = (hash ^ (unsigned char) *p) * 16777619u;
+  for (slot = hash & (COMMAND_CACHE_SIZE - 1); command_cache[slot].name[0] != 0;
+       slot = (slot + 1) & (COMMAND_CACHE_SIZE - 1))
+    if (!strcmp(command_cache[slot].name, name))
+      break;
+  entry = &command_cache[slot];
+
+  if (entry->name[0] == 0) {
+    // Keep the table at most three quarters full so probes stay short
+    if (command_count == COMMAND_CACHE_SIZE * 3 / 4) {
+      forget_commands();
+      return resolve_command(name, path);
+    }
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->function = find_function(name);
+    entry->handler = find_builtin(name);
+    command_count++;
+    command_misses++;
+  } else if (path && !entry->searched)
+    command_misses++;
+  else
+    command_hits++;
+
+  if (path && !entry->searched) {
+    entry->path = search_path(name);
+    entry->searched = true;
+  }
+  entry->hits++;
+  return entry;
+}
+
+/**
+ * @brief  Outputs where each command would be found on the PATH
+ * @param  Argument count
+ * @param  Arguments: name...
+ * @return -1 if any name was not found, 0 on success
+ */
+int do_which(int argc, char** argv) {
+  int result = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "which: Usage: which name...\n");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++) {
+    struct command_entry* command = resolve_command(argv[i], true);
+
+    if (command->path == NULL) {
+      result = -1;
+      continue;
+    }
+    out_write(command->path, strlen(command->path));
+    out_char('\n');
+  }
+  return result;
+}
+
+/**
+ * @brief  Describes how each command would be run
+ * @param  Argument count
+ * @param  Arguments: name...
+ * @return -1 if any name was not found, 0 on success
+ */
+int do_type(int argc, char** argv) {
+  int result = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "type: Usage: type name...\n");
+    return -1;
+  }
+  for (int i = 1; i < argc; i++) {
+    struct command_entry* command = resolve_command(argv[i], true);
+
+    if (command->function != NULL && command->function->alias)
+      printf("%s is aliased to `%s'\n", argv[i], command->function->text);
+    else if (command->function != NULL)
+      printf("%s is a function\n", argv[i]);
+    else if (command->handler != NULL)
+      printf("%s is a shell builtin\n", argv[i]);
+    else if (command->path != NULL)
+      printf("%s is %s\n", argv[i], command->path);
+    else {
+      fprintf(stderr, "type: %s: not found\n", argv[i]);
+      result = -1;
+    }
+  }
+  return result;
+}
+
+/**
+ * @brief  Shows, fills or empties the table of resolved command names
+ *           hash           lists names with their hits, then table statistics
+ *           hash name...   resolves names ahead of use, searching the PATH
+ *           hash -r        empties the table
+ * @param  Argument count
+ * @param  Arguments
+ * @return -1 if any name was not found, 0 on success
+ */
+int do_hash(int argc, char** argv) {
+  int result = 0;
+
+  if (argc == 2 && !strcmp(argv[1], "-r")) {
+    forget_commands();
+    return 0;
+  }
+  if (argc == 1) {
+    printf("hits\tname\tcommand\n");
+    for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+      struct command_entry* command = &command_cache[i];
+      if (command->name[0] == 0)
+        continue;
+      printf("%4lu\t%s\t%s\n", command->hits, command->name,
+             command->function != NULL ? command->function->alias ? "(alias)" : "(function)"
+             : command->handler != NULL ? "(builtin)"
+             : command->path != NULL ? command->path : command->searched ? "(not found)" : "(unknown)");
+    }
+    printf("%d of %d slots used, %lu hits, %lu misses\n", command_count,
+           COMMAND_CACHE_SIZE, command_hits, command_misses);
+    return 0;
+  }
+  for (int i = 1; i < argc; i++) {
+    struct command_entry* command = resolve_command(argv[i], true);
 
+    // Warming the table does not count as using the command
+    command->hits--;
+    if (command->function == NULL && command->handler == NULL && command->path == NULL) {
+      fprintf(stderr, "hash: %s: not found\n", argv[i]);
+      result = -1;
+    }
+  }
+  return result;
+}
+
+/**
+ * @brief  Runs a command given as an argument vector. Aliases and functions
+ *         take precedence over builtins, except inside their own bodies:
+ *         there the name means the builtin, so alias ls=ls --color works.
+ * @param  Argument count
+ * @param  Argument vector
+ * @return Return value of the command, or -1 if there is no such command
+ */
+int run_argv(int argc, char** argv) {
+  struct command_entry* command;
+  bool shadowed = false;
+
+  if (argc == 0)
+    return -1;
+  command = resolve_command(argv[0], false);
+  for (int i = 0; i < running_count && command->function != NULL; i++)
+    shadowed |= running[i] == command->function;
+  if (command->function != NULL && !shadowed)
+    return call_function(command->function, argc, argv);
+  if (command->handler != NULL)
+    return run_handler(command->handler, argc, argv);
+  out_flush();
+  fprintf(stderr, "myshell: %s: No such file or directory\n", argv[0]);
   return -1;
 }
+
+/**
+ * @brief  Releases an alias or function body
+ * @param  Definition to release
+ */
+void free_function(struct shell_function* function) {
+  for (int i = 0; i < function->count; i++) {
+    free(function->commands[i].argv);
+    free(function->commands[i].params);
+  }
+  free(function->commands);
+  free(function->storage);
+  free(function->name);
+}
+
+/**
+ * @brief  Tokenizes the body of an alias or function once, when it is
+ *         defined. Each command is split into words and positional
+ *         parameters ($1 to $9, and $@ for all of them) are noted. The
+ *         command name is resolved on each call, through the command table,
+ *         so aliases and functions defined later take their usual precedence.
+ * @param  Definition receiving the compiled body
+ * @param  Body text: commands separated by semicolons
+ * @return -1 on error, 0 on success
+ */
+int compile_body(struct shell_function* function, const char* body) {
+  char* position;
+
+  function->storage = strdup(body);
+  function->commands = calloc(MAX_FUNCTION_COMMANDS, sizeof(struct compiled_command));
+  function->count = 0;
+  for (char* text = strtok_r(function->storage, ";", &position); text != NULL;
+       text = strtok_r(NULL, ";", &position)) {
+    struct compiled_command* command = &function->commands[function->count];
+    char* words[MAX_ARGS];
+
+    if (function->count == MAX_FUNCTION_COMMANDS) {
+      fprintf(stderr, "myshell: %s: Too many commands\n", function->name);
+      return -1;
+    }
+    // Substitutions must run on every call, so keep those commands as text
+    if (strstr(text, "$(") != NULL) {
+      command->text = text;
+      function->count++;
+      continue;
+    }
+    if ((command->argc = split_args(text, words)) == 0)
+      continue;
+    command->argv = malloc((command->argc + 1) * sizeof(char*));
+    command->params = calloc(command->argc, sizeof(signed char));
+    memcpy(command->argv, words, (command->argc + 1) * sizeof(char*));
+    for (int i = 0; i < command->argc; i++)
+      if (words[i][0] == '$' && isdigit(words[i][1]) && words[i][1] != '0' && words[i][2] == 0)
+        command->params[i] = words[i][1] - '0';
+      else if (!strcmp(words[i], "$@"))
+        command->params[i] = -1;
+      else if (strchr(words[i], '$') != NULL)
+        command->params[i] = -2;
+    function->count++;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Fills in the parameters used inside a word or a command
+ * @param  Text containing $1 to $9 or $@
+ * @param  Argument count of the call
+ * @param  Argument vector of the call
+ * @param  Buffer receiving the text
+ * @param  Size of the buffer
+ * @return Length of the text written
+ */
+size_t substitute_params(const char* word, int argc, char** argv, char* out, size_t size) {
+  size_t used = 0;
+
+  for (; *word != 0 && used < size - 1; word++)
+    if (word[0] == '$' && isdigit(word[1]) && word[1] != '0') {
+      int n = *++word - '0';
+      if (n < argc)
+        used += snprintf(out + used, size - used, "%s", argv[n]);
+      if (used >= size)
+        used = size - 1;
+    } else if (word[0] == '$' && word[1] == '@') {
+      word++;
+      for (int k = 1; k < argc && used < size - 1; k++)
+        used += snprintf(out + used, size - used, k > 1 ? " %s" : "%s", argv[k]);
+      if (used >= size)
+        used = size - 1;
+    } else
+      out[used++] = *word;
+  out[used] = 0;
+  return used;
+}
+
+/**
+ * @brief  Runs an alias or function. The stored words are combined with the
+ *         call's arguments by copying pointers only, and each command name
+ *         costs one probe of the command table.
+ * @param  Definition to run
+ * @param  Argument count of the call
+ * @param  Argument vector of the call
+ * @return Return value of the last command
+ */
+int call_function(struct shell_function* function, int argc, char** argv) {
+  int result = 0;
+
+  if (running_count == MAX_CALL_DEPTH) {
+    fprintf(stderr, "myshell: %s: Calls nested too deeply\n", function->name);
+    return -1;
+  }
+  running[running_count++] = function;
+  for (int i = 0; i < function->count; i++) {
+    struct compiled_command* command = &function->commands[i];
+    char* words[MAX_ARGS];
+    char scratch[EXPANDED_SIZE];
+    size_t used = 0;
+    int count = 0;
+
+    // Parameters are filled in before the substitutions run, so that
+    // $(echo $1) sees the call's argument
+    if (command->text != NULL) {
+      char line[EXPANDED_SIZE];
+      used = substitute_params(command->text, argc, argv, scratch, sizeof(scratch));
+      for (int k = 1; function->alias && k < argc && used < sizeof(scratch) - 1; k++)
+        used += snprintf(scratch + used, sizeof(scratch) - used, " %s", argv[k]);
+      if ((result = expand_substitutions(scratch, line, sizeof(line))) == 0)
+        result = execute_command(line);
+      continue;
+    }
+    for (int j = 0; j < command->argc && count < MAX_ARGS - 1; j++)
+      if (command->params[j] == 0)
+        words[count++] = command->argv[j];
+      else if (command->params[j] > 0 && command->params[j] < argc)
+        words[count++] = argv[(int) command->params[j]];
+      else if (command->params[j] == -1)
+        for (int k = 1; k < argc && count < MAX_ARGS - 1; k++)
+          words[count++] = argv[k];
+      else if (command->params[j] == -2 && used < sizeof(scratch) - 1) {
+        words[count++] = scratch + used;
+        used += substitute_params(command->argv[j], argc, argv, scratch + used,
+                                  sizeof(scratch) - used) + 1;
+      }
+    // An alias passes its own arguments on after the body
+    for (int k = 1; function->alias && k < argc && count < MAX_ARGS - 1; k++)
+      words[count++] = argv[k];
+    words[count] = NULL;
+
+    result = run_argv(count, words);
+  }
+  running_count--;
+  return result;
+}
+
+/**
+ * @brief  Defines, replaces or lists aliases and functions. Bodies are not
+ *         expanded when defined.
+ *           alias                 lists aliases and functions
+ *           alias NAME=COMMAND    defines an alias
+ *           function NAME { COMMAND; COMMAND }
+ *           unalias NAME          removes an alias or function
+ * @param  Command line
+ * @return -1 on error, 0 on success
+ */
+int define_command(const char* line) {
+  struct shell_function function = {0};
+  struct shell_function* existing;
+  const char* body;
+  const char* end;
+  char name[MAX_FILENAME_LENGTH];
+
+  if (!strcmp(line, "alias")) {
+    for (int i = 0; i < function_count; i++)
+      printf("%s %s: %s\n", functions[i].alias ? "alias" : "function",
+             functions[i].name, functions[i].text);
+    return 0;
+  }
+  if (sscanf(line, "unalias %255s", name) == 1) {
+    if ((existing = find_function(name)) == NULL) {
+      fprintf(stderr, "unalias: %s: Not found\n", name);
+      return -1;
+    }
+    free_function(existing);
+    free(existing->text);
+    *existing = functions[--function_count];
+    forget_commands();
+    return 0;
+  }
+
+  if (!strncmp(line, "alias ", 6)) {
+    function.alias = true;
+    line += 6;
+    if ((body = strchr(line, '=')) == NULL || body == line) {
+      fprintf(stderr, "alias: Usage: alias NAME=COMMAND\n");
+      return -1;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int) (body++ - line), line);
+    end = body + strlen(body);
+  } else {
+    if (sscanf(line, "function %255s", name) != 1 || (body = strchr(line, '{')) == NULL ||
+        (end = strrchr(line, '}')) == NULL || end < body) {
+      fprintf(stderr, "function: Usage: function NAME { COMMAND; COMMAND }\n");
+      return -1;
+    }
+    body++;
+  }
+  if (function_count == MAX_FUNCTIONS && find_function(name) == NULL) {
+    fprintf(stderr, "myshell: Too many aliases and functions\n");
+    return -1;
+  }
+
+  function.name = strdup(name);
+  function.text = strndup(body, end - body);
+  if (compile_body(&function, function.text) == -1) {
+    free_function(&function);
+    free(function.text);
+    return -1;
+  }
+  if ((existing = find_function(name)) != NULL) {
+    free_function(existing);
+    free(existing->text);
+    *existing = function;
+  } else
+    functions[function_count++] = function;
+  forget_commands();
+  return 0;
+}
+
+/**
+ * @brief  Checks whether a command line defines or removes an alias or
+ *         function, which must not have its substitutions expanded
+ * @param  Command line
+ * @return Whether the line is a definition
+ */
+bool is_definition(const char* line) {
+  return !strcmp(line, "alias") || !strncmp(line, "alias ", 6) ||
+         !strncmp(line, "unalias ", 8) || !strncmp(line, "function ", 9);
+}
+
+/**
+ * @brief  Executes a shell command. Checks for invalid commands.
+ * @param  Char array representing the command to execute
+ * @return Return value of command being executed, or -1 for invalid command
+ */
+int execute_command(char* buffer)  {
+  char words[EXPANDED_SIZE];
+  char* argv[MAX_ARGS];
+  int argc;
+
+  if (is_definition(buffer))
+    return define_command(buffer);
+
+  strncpy(words, buffer, sizeof(words) - 1);
+  words[sizeof(words) - 1] = 0;
+  argc = split_args(words, argv);
+  if (argc == 0)
+    return -1;
+  return run_argv(argc, argv);
+}
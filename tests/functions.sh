@@ -0,0 +1,25 @@
+#!/bin/sh
+# Checks that alias and function bodies see the call's positional parameters,
+# including inside $(...) substitutions, and that a definition naming itself
+# runs the builtin.
+# Usage: tests/functions.sh [path to myshell]
+
+shell=${1:-./myshell}
+
+# Prompts share lines with the output, so strip them before comparing
+actual=$(printf '%s\n' \
+  "function f { echo \$(basename \$1) }" \
+  "f /tmp/a" \
+  "function g { echo \$(echo \$2 \$1) \$@ }" \
+  "g one two" \
+  "alias echo=echo said" \
+  "echo hi" \
+  "q" | "$shell" 2>&1 | sed 's/myshell:[^>]*> //g')
+
+expected=$(printf '%s\n' a "two one one two" "said hi")
+
+if [ "$actual" != "$expected" ]; then
+  printf 'FAIL\nexpected:\n%s\nactual:\n%s\n' "$expected" "$actual"
+  exit 1
+fi
+echo PASS